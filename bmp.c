@@ -75,8 +75,11 @@ warn(const char *msg, const char *fname)
 static void 
 ref_free(struct ref_s *ref)
 {
-	free(ref->bmp->img);
-	free(ref->bmp->palette);
+	/* archive views don't own their image or palette. */
+	if (!ref->bmp->pack) {
+		free(ref->bmp->img);
+		free(ref->bmp->palette);
+	}
 	free(ref->bmp);
 	free(ref);
 }
@@ -155,12 +158,134 @@ init(const char *name)
 		bmp->name[PATH_MAX-1] = '\0';	
 		bmp->img = NULL;
 		bmp->palette = NULL;
+		bmp->stride = 0;
+		bmp->img_bytes = 0;
+		bmp->pack = NULL;
 		ref_add(bmp);
 	}
 	return bmp;
 }
 	
 
+/*
+ * bytes per scanline of a w pixel wide image at the given bit depth,
+ * padded to a double word boundary. returns 0 if the width is zero or
+ * the scanline can't be represented in a size_t.
+ */
+static int
+row_size(unsigned int w, unsigned int bpp, size_t *stride)
+{
+	if (!w || !bpp || w > ((size_t)-1 - 31) / bpp) {
+		return 0;
+	}
+	*stride = (((size_t)w * bpp + 31) >> 5) << 2;
+	return 1;
+}
+
+
+/*
+ * set the bit depth of bmp and work out its scanline stride and raster
+ * size, checking each step for overflow. the 32 bit header fields can't
+ * describe a raster of 4GB or more, so in that case they are set to 0,
+ * which is legal for uncompressed images. returns 0 if the image is too
+ * large to be held in memory.
+ */
+static int
+set_size(bitmap_s *bmp, unsigned int bpp)
+{
+	size_t stride, bytes;
+
+	if (!row_size(bmp->ih.w,bpp,&stride) || !bmp->ih.h
+	    || stride > (size_t)-1 / bmp->ih.h) {
+		return 0;
+	}
+	bytes = stride * bmp->ih.h;
+
+	bmp->ih.bpp = bpp;
+	bmp->stride = stride;
+	bmp->img_bytes = bytes;
+	bmp->ih.img_size = (bytes <= 0xFFFFFFFFUL) ? bytes : 0;
+	bmp->fh.file_size = (bytes <= 0xFFFFFFFFUL - bmp->fh.dib_offset)
+		? bmp->fh.dib_offset + bytes : 0;
+
+	return 1;
+}
+
+
+/*
+ * check that the file holds h scanlines of stride bytes from offset off,
+ * so a corrupt header can't have us allocate memory for an image that
+ * isn't there.
+ */
+static int
+file_holds(FILE *f, off_t off, size_t stride, unsigned int h)
+{
+	off_t end;
+
+	if (!h || fseeko(f,0,SEEK_END) == -1 || (end = ftello(f)) < off) {
+		return 0;
+	}
+	return ((end - off) / h >= stride);
+}
+
+
+/*
+ * size of the palette of bmp in bytes. num_colors of 0 means the full
+ * 2^bpp entries for images of 8 bits or less.
+ */
+static size_t
+palette_bytes(bitmap_s *bmp)
+{
+	if (bmp->ih.num_colors) {
+		return (size_t)bmp->ih.num_colors << 2;
+	}
+	return (bmp->ih.bpp <= 8) ? (size_t)4 << bmp->ih.bpp : 0;
+}
+
+
+/*
+ * allocate a new w by h bitmap named name, at the given bit depth, with
+ * headers taken from src. the palette is copied when the bit depth is
+ * unchanged. returns NULL with a warning if the image is too large.
+ */
+static bitmap_s *
+derive(bitmap_s *src, const char *name, unsigned int w, unsigned int h,
+	unsigned int bpp)
+{
+	bitmap_s *bmp;
+	size_t n;
+
+	if (!(bmp = init(name))) {
+		fatal("memory exhausted");
+	}
+
+	bmp->fh = src->fh;
+	bmp->ih = src->ih;
+	bmp->ih.w = w;
+	bmp->ih.h = h;
+
+	/* each scanline of the image must end on a double word boundary. */
+	if (!set_size(bmp,bpp)) {
+		warn("image too large",name);
+		return bmp_destroy(bmp);
+	}
+
+	if (!(bmp->img = malloc(bmp->img_bytes))) {
+		fatal("memory exhausted");
+	}
+
+	if (src->palette && src->ih.bpp == bpp) {
+		n = palette_bytes(src);
+		if (!(bmp->palette = malloc(n))) {
+			fatal("memory exhausted");
+		}
+		memcpy(bmp->palette,src->palette,n);
+	}
+
+	return bmp;
+}
+
+
 /*
  * validate the signature field of the bitmap file header.
  */
@@ -247,6 +372,32 @@ get_ih(bitmap_s *bmp, FILE *f)
 }
 
 
+/*
+ * read the palette of an image of 8 bits per pixel or less, which follows
+ * the info header. other images have no palette, so always succeed.
+ */
+static int
+get_pal(bitmap_s *bmp, FILE *f)
+{
+	size_t n;
+
+	if (bmp->ih.bpp > 8) {
+		return 1;
+	}
+	if (bmp->ih.num_colors > (1U << bmp->ih.bpp)) {
+		return 0;
+	}
+
+	n = palette_bytes(bmp);
+	if (!(bmp->palette = malloc(n))) {
+		fatal("memory exhausted");
+	}
+
+	return (fseeko(f,(off_t)14 + bmp->ih.ih_size,SEEK_SET) != -1
+		&& fread(bmp->palette,1,n,f) == n);
+}
+
+
 /* 
  * read and validate the bitmaps raster image.
  * scanlines are positioned in memory upside down. each scanline is
@@ -265,232 +416,2209 @@ get_ih(bitmap_s *bmp, FILE *f)
 static int
 get_dib(bitmap_s *bmp, FILE *f)
 {
-	/* we want bytes per pixel, not bits per pixel here */
-	size_t sz = bmp->ih.img_size;
-	unsigned char *img = malloc(sz); 
-	int w = sz / bmp->ih.h;
+	unsigned int h = bmp->ih.h, y = 0;
 
-	if (img) {
-		while (sz) {
-			/* start at last scanline */
-			if (fseek(f,bmp->fh.dib_offset + sz-w,SEEK_SET)!= -1) {
-				sz -= fread(img + bmp->ih.img_size - sz,1,w,f);
-			} else {
+	/* the size is worked out from the dimensions rather than trusting
+	   img_size, which may be 0 or may not fit in 32 bits. */
+	if (!set_size(bmp,bmp->ih.bpp)
+	    || !file_holds(f,bmp->fh.dib_offset,bmp->stride,h)) {
+		return 0;
+	}
+	if (!(bmp->img = malloc(bmp->img_bytes))) {
+		fatal("memory exhausted");
+	}
+
+	/* read scanlines in file order, filling memory from the bottom. */
+	if (fseeko(f,(off_t)bmp->fh.dib_offset,SEEK_SET) != -1) {
+		for (; y < h; y++) {
+			if (fread(bmp->img + (h - y - 1) * bmp->stride,1,
+				  bmp->stride,f) != bmp->stride) {
 				break;
-			}	
+			}
 		}
 	}
-	bmp->img = img;
 
-	return (sz == 0);
+	return (y == h);
 }
 
 
-/*---------------- BEGIN PUBLIC INTERFACE ----------------
- *
- * these functions are well documented in the header file.
- * please refer to bmp.h for verbose details.
- *
+/*
+ * output byte layout for each bmp_order_e. every entry names the source
+ * channel that is stored in that byte of the output pixel, where
+ * 0 = blue, 1 = green, 2 = red and 3 = alpha. 24 bit orders ignore the
+ * last entry.
  */
+static const unsigned char order_map[][4] = {
+	{ 0, 1, 2, 3 },		/* BMP_BGRA */
+	{ 2, 1, 0, 3 },		/* BMP_RGBA */
+	{ 3, 2, 1, 0 },		/* BMP_ARGB */
+	{ 3, 0, 1, 2 },		/* BMP_ABGR */
+	{ 0, 1, 2, 3 },		/* BMP_BGR */
+	{ 2, 1, 0, 3 }		/* BMP_RGB */
+};
 
 
-/* return pointer to image, NULL on error. */
-void *
-bmp_get_img(bitmap bmp)
+/*
+ * bits per pixel produced by a channel order, or 0 if the order is unknown.
+ */
+static int
+order_bpp(bmp_order_e order)
 {
-	if (ref_exists(bmp)) {
-		return bmp->img;
+	switch (order) {
+	case BMP_BGRA: case BMP_RGBA: case BMP_ARGB: case BMP_ABGR:
+		return 32;
+	case BMP_BGR: case BMP_RGB:
+		return 24;
 	}
-	return NULL;
-}	
+	return 0;
+}
 
 
-/* returns an initialised and validated bitmap_s struct, NULL on error.  */
-bitmap 
-bmp_load(const char *fname)
+/*
+ * rearrange one scanline of w pixels from src, sn bytes per pixel in BGR(X)
+ * order, into dst using the given channel order. with SSSE3 four pixels are
+ * shuffled per step. each step loads and stores 16 bytes, so it stops 6
+ * pixels short of the end of the scanline and leaves the rest to the scalar
+ * loop, which never touches memory beyond the end of either row.
+ */
+static void
+swizzle_row(unsigned char *dst, const unsigned char *src, unsigned int w,
+	int sn, bmp_order_e order, unsigned char alpha)
 {
-	FILE *f;
-	int error = 1;
-	bitmap_s *bmp = NULL;
-		
-	if (!(f = fopen(fname,"rb"))) {
-		warn("failed to open",fname);
-	} else if (!(bmp = init(fname))) {
-		fatal("Memory exhausted");
-	} else if (!get_fh(bmp,f)) {
-		warn("invalid image file",fname);
-	} else if (!get_ih(bmp,f)) {
-		warn("image header corrupt",fname);
-	} else if (!get_dib(bmp,f)) {
-		warn("image data corrupt",fname);
-	} else {	
-		fclose(f);
-		error = 0;
-	}	
-	
-	if (error) {
-		bmp = bmp_destroy(bmp);
-	}	
-	
-	return (bitmap)bmp;
-}
+	const unsigned char *map = order_map[order];
+	int dn = order_bpp(order) >> 3;
+	unsigned char px[4];
+	unsigned int x = 0;
+	int k;
+
+#ifdef __SSSE3__
+	if (w >= 6) {
+		unsigned char m[16], a[16];
+		__m128i mask, av;
+		int p;
+
+		for (p = 0; p < 16; p++) {
+			m[p] = 0x80;
+			a[p] = 0;
+		}
+		for (p = 0; p < 4; p++) {
+			for (k = 0; k < dn; k++) {
+				if (map[k] == 3) {
+					a[p * dn + k] = alpha;
+				} else {
+					m[p * dn + k] = p * sn + map[k];
+				}
+			}
+		}
+		mask = _mm_loadu_si128((const __m128i *)m);
+		av   = _mm_loadu_si128((const __m128i *)a);
 
+		for (; x + 6 <= w; x += 4, src += 4 * sn, dst += 4 * dn) {
+			__m128i v = _mm_loadu_si128((const __m128i *)src);
+			v = _mm_or_si128(_mm_shuffle_epi8(v,mask),av);
+			_mm_storeu_si128((__m128i *)dst,v);
+		}
+	}
+#endif
 
-/* return image width from valid bitmap_s struct. */
-int
-bmp_get_width(bitmap bmp)
-{
-	return bmp->ih.w;
+	px[3] = alpha;
+	for (; x < w; x++, src += sn, dst += dn) {
+		px[0] = src[0];
+		px[1] = src[1];
+		px[2] = src[2];
+		for (k = 0; k < dn; k++) {
+			dst[k] = px[map[k]];
+		}
+	}
 }
 
 
-/* return image height from valid bitmap_s struct. */
-int
-bmp_get_height(bitmap bmp)
+/*
+ * read the raster image of a 24 or 32 bit bitmap, rearranging each scanline
+ * into the given channel order on the way in. scanlines end up in the same
+ * top to bottom order as get_dib produces. the headers are updated to
+ * describe the new image.
+ */
+static int
+get_dib_order(bitmap_s *bmp, FILE *f, bmp_order_e order, unsigned char alpha)
 {
-	return bmp->ih.h;
+	unsigned int h = bmp->ih.h, y = 0;
+	int sn = bmp->ih.bpp >> 3;
+	unsigned char *row;
+	size_t sw;
+
+	if (!row_size(bmp->ih.w,bmp->ih.bpp,&sw)
+	    || !file_holds(f,bmp->fh.dib_offset,sw,h)
+	    || !set_size(bmp,order_bpp(order))) {
+		return 0;
+	}
+	if (!(row = malloc(sw)) || !(bmp->img = malloc(bmp->img_bytes))) {
+		fatal("memory exhausted");
+	}
+
+	/* read scanlines in file order, filling memory from the bottom. */
+	if (fseeko(f,(off_t)bmp->fh.dib_offset,SEEK_SET) != -1) {
+		for (; y < h; y++) {
+			if (fread(row,1,sw,f) != sw) {
+				break;
+			}
+			swizzle_row(bmp->img + (h - y - 1) * bmp->stride,row,
+				bmp->ih.w,sn,order,alpha);
+		}
+	}
+	free(row);
+
+	return (y == h);
 }
 
 
-/* returns a new bitmap_s stuct containing a 32 bit image, converted from 
-   given bitmap_s struct containing 24 bit image. name is the new filename
-   for the image. */
-bitmap
-bmp_convert24to32(bitmap bmp24, char *name)
+/*
+ * copy the pixels of src rows y0 to y1 and columns x0 to x1 (exclusive) of
+ * an n byte per pixel image into dst, swapping rows and columns.
+ */
+static void
+transpose_scalar(unsigned char *dst, ptrdiff_t ds, const unsigned char *src,
+	ptrdiff_t ss, unsigned int x0, unsigned int x1, unsigned int y0,
+	unsigned int y1, int n)
 {
-	bitmap_s *bmp32;
-	int pad, i, j;
+	unsigned int x, y;
+	int k;
 
-	if (!bmp24) {
-		return NULL;
-	}
-	
-	if (!(bmp32 = init(name))) {
-		fatal("memory exhausted");
-	}	
-	
-	bmp32->fh = bmp24->fh;
-	bmp32->ih = bmp24->ih;
-	bmp32->ih.bpp = 32;
+	for (y = y0; y < y1; y++) {
+		const unsigned char *s = src + (ptrdiff_t)y * ss + x0 * n;
+		unsigned char *d = dst + (ptrdiff_t)x0 * ds + y * n;
 
-	/* each scanline of the image must end on a double word boundary. */
-	pad = bmp24->ih.w % sizeof(int);
-	bmp32->ih.img_size = ((bmp24->ih.w + pad) * bmp24->ih.h << 2);
+		for (x = x0; x < x1; x++, s += n, d += ds) {
+			for (k = 0; k < n; k++) {
+				d[k] = s[k];
+			}
+		}
+	}
+}
 
-	/* calculate total file size for new bitmap. */
-	bmp32->fh.file_size = bmp32->fh.dib_offset + bmp32->ih.img_size;
-	
-	if (!(bmp32->img = malloc(bmp32->ih.img_size))) {
-		fatal("memory exhausted");
-	}		
-
-	for (i = 0, j = 0; i < bmp24->ih.w * bmp24->ih.h; i++, j += 3) {
-		((unsigned int *)bmp32->img)[i] =
-			(((unsigned int)bmp24->img[j]<<0)
-			|((unsigned int)bmp24->img[j+1]<<8)
-			|((unsigned int)bmp24->img[j+2]<<16))
-			&(0x00FFFFFF);
-
-			/* any padding bytes should be added to the end of
-			   each of the new scanlines. */
-			if (i % bmp24->ih.w == 0)
-				j += pad;
-	}	
 
-	return (bitmap)bmp32;
+#ifdef __SSE2__
+/*
+ * transpose an 8x8 block of 8 bit pixels held entirely in registers.
+ */
+static void
+transpose8_8x8(unsigned char *d, ptrdiff_t ds, const unsigned char *s,
+	ptrdiff_t ss)
+{
+	__m128i a0, a1, a2, a3, b0, b1, b2, b3, c[4];
+	int i;
+
+	a0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)s),
+		_mm_loadl_epi64((const __m128i *)(s + ss)));
+	a1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(s + 2 * ss)),
+		_mm_loadl_epi64((const __m128i *)(s + 3 * ss)));
+	a2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(s + 4 * ss)),
+		_mm_loadl_epi64((const __m128i *)(s + 5 * ss)));
+	a3 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(s + 6 * ss)),
+		_mm_loadl_epi64((const __m128i *)(s + 7 * ss)));
+
+	b0 = _mm_unpacklo_epi16(a0,a1);
+	b1 = _mm_unpackhi_epi16(a0,a1);
+	b2 = _mm_unpacklo_epi16(a2,a3);
+	b3 = _mm_unpackhi_epi16(a2,a3);
+
+	/* each register now holds two destination rows */
+	c[0] = _mm_unpacklo_epi32(b0,b2);
+	c[1] = _mm_unpackhi_epi32(b0,b2);
+	c[2] = _mm_unpacklo_epi32(b1,b3);
+	c[3] = _mm_unpackhi_epi32(b1,b3);
+
+	for (i = 0; i < 4; i++, d += 2 * ds) {
+		_mm_storel_epi64((__m128i *)d,c[i]);
+		_mm_storel_epi64((__m128i *)(d + ds),
+			_mm_unpackhi_epi64(c[i],c[i]));
+	}
 }
 
 
-/* returns a new bitmap_s stuct containing a 16 bit image, converted from 
-   given bitmap_s struct containing 24 bit image. name is the new filename
-   for the image. */
-bitmap 
-bmp_convert24to16(bitmap bmp24, char *name)
+/*
+ * transpose an 8x8 block of 16 bit pixels held entirely in registers.
+ */
+static void
+transpose16_8x8(unsigned char *d, ptrdiff_t ds, const unsigned char *s,
+	ptrdiff_t ss)
 {
-	bitmap_s *bmp16;
-	int i, j, pad;
+	__m128i r[8], a[8], b[8];
+	int i;
 
-	if (!bmp24) {
-		return NULL;
+	for (i = 0; i < 8; i++) {
+		r[i] = _mm_loadu_si128((const __m128i *)(s + i * ss));
 	}
+	for (i = 0; i < 4; i++) {
+		a[2 * i]     = _mm_unpacklo_epi16(r[2 * i],r[2 * i + 1]);
+		a[2 * i + 1] = _mm_unpackhi_epi16(r[2 * i],r[2 * i + 1]);
+	}
+	for (i = 0; i < 2; i++) {
+		b[4 * i]     = _mm_unpacklo_epi32(a[4 * i],a[4 * i + 2]);
+		b[4 * i + 1] = _mm_unpackhi_epi32(a[4 * i],a[4 * i + 2]);
+		b[4 * i + 2] = _mm_unpacklo_epi32(a[4 * i + 1],a[4 * i + 3]);
+		b[4 * i + 3] = _mm_unpackhi_epi32(a[4 * i + 1],a[4 * i + 3]);
+	}
+	for (i = 0; i < 4; i++) {
+		_mm_storeu_si128((__m128i *)(d + 2 * i * ds),
+			_mm_unpacklo_epi64(b[i],b[i + 4]));
+		_mm_storeu_si128((__m128i *)(d + (2 * i + 1) * ds),
+			_mm_unpackhi_epi64(b[i],b[i + 4]));
+	}
+}
 
-	if (!(bmp16 = init(name))) {
-		fatal("memory exhausted");
-	}	
-
-	bmp16->fh = bmp24->fh;
-	bmp16->ih = bmp24->ih;
-	bmp16->ih.bpp = 16;
-		
-	/* each scanline of the image must end on a double word boundary. */
-        pad = bmp24->ih.w % sizeof(int);
-	bmp16->ih.img_size = ((bmp24->ih.w + pad) * bmp24->ih.h << 1);
 
-	/* calculate total file size for new bitmap */
-	bmp16->fh.file_size = bmp16->fh.dib_offset + bmp16->ih.img_size;
+/*
+ * transpose a 4x4 block of 32 bit pixels held entirely in registers.
+ */
+static void
+transpose32_4x4(unsigned char *d, ptrdiff_t ds, const unsigned char *s,
+	ptrdiff_t ss)
+{
+	__m128i r0, r1, r2, r3, a0, a1, a2, a3;
+
+	r0 = _mm_loadu_si128((const __m128i *)s);
+	r1 = _mm_loadu_si128((const __m128i *)(s + ss));
+	r2 = _mm_loadu_si128((const __m128i *)(s + 2 * ss));
+	r3 = _mm_loadu_si128((const __m128i *)(s + 3 * ss));
+
+	a0 = _mm_unpacklo_epi32(r0,r1);
+	a1 = _mm_unpackhi_epi32(r0,r1);
+	a2 = _mm_unpacklo_epi32(r2,r3);
+	a3 = _mm_unpackhi_epi32(r2,r3);
+
+	_mm_storeu_si128((__m128i *)d,_mm_unpacklo_epi64(a0,a2));
+	_mm_storeu_si128((__m128i *)(d + ds),_mm_unpackhi_epi64(a0,a2));
+	_mm_storeu_si128((__m128i *)(d + 2 * ds),_mm_unpacklo_epi64(a1,a3));
+	_mm_storeu_si128((__m128i *)(d + 3 * ds),_mm_unpackhi_epi64(a1,a3));
+}
+#endif
 
-	if (!(bmp16->img = malloc(bmp16->ih.img_size))) {
-		fatal("memory exhausted");
-	}	
-	
-        for (i = 0, j = 0; i < bmp24->ih.w * bmp24->ih.h; i++, j += 3) {
-                ((unsigned short *)bmp16->img)[i] = (bmp24->img[j]&0xF8)>>3
-                        |(bmp24->img[j+1]&0xFC)<<3
-                        |(bmp24->img[j+2]&0xF8)<<8;
-
-			/* any padding bytes should be added to the end of
-			   each of the new scanlines. */
-                        if (i % bmp24->ih.w == 0) {
-                                j += pad;
-			}	
-        }
 
-        return (bitmap)bmp16;
-}
+#ifdef __SSE2__
+/*
+ * transpose as much of the tile between columns x0 and x1 and rows y0 and
+ * y1 as fits in whole register blocks, finishing the columns to the right
+ * of the blocks one pixel at a time. returns the first row not yet moved,
+ * which is y0 when n has no block kernel.
+ */
+static unsigned int
+transpose_blocks(unsigned char *dst, ptrdiff_t ds, const unsigned char *src,
+	ptrdiff_t ss, unsigned int x0, unsigned int x1, unsigned int y0,
+	unsigned int y1, int n)
+{
+	int b = (n == 4) ? 4 : (n == 1 || n == 2) ? 8 : 0;
+	unsigned int bx, by, x, y;
 
+	if (!b) {
+		return y0;
+	}
 
-/* cleanup memory allocated previously to the given bitmap_s struct. */
-void *
-bmp_destroy(bitmap bmp)
-{	
-	struct ref_s *ref;
-	
-	if (bmp) {
-		if ((ref = ref_exists(bmp))) {
-			ref_del(ref);
+	bx = x0 + (x1 - x0) / b * b;
+	by = y0 + (y1 - y0) / b * b;
+	for (y = y0; y < by; y += b) {
+		for (x = x0; x < bx; x += b) {
+			const unsigned char *s = src + (ptrdiff_t)y * ss + x * n;
+			unsigned char *d = dst + (ptrdiff_t)x * ds + y * n;
+
+			if (n == 1) {
+				transpose8_8x8(d,ds,s,ss);
+			} else if (n == 2) {
+				transpose16_8x8(d,ds,s,ss);
+			} else {
+				transpose32_4x4(d,ds,s,ss);
+			}
 		}
-	}	
-	
-	return NULL;
+	}
+	transpose_scalar(dst,ds,src,ss,bx,x1,y0,by,n);
+
+	return by;
 }
+#endif
 
 
-/* cleanup memory allocated to all previously allocated bitmap_s structs. */ 
-void
-bmp_gc(void)
+/*
+ * transpose a w by h image of n byte pixels from src into dst, so that
+ * column x of src becomes row x of dst. strides may be negative, which
+ * is how the rotations mirror one axis in the same pass. the image is
+ * walked in TILE x TILE tiles so both source and destination stay in
+ * cache, and with SSE2 each tile is moved in blocks transposed in
+ * registers. 24 bit pixels, and the edges of each tile, are moved one
+ * pixel at a time.
+ */
+static void
+transpose(unsigned char *dst, ptrdiff_t ds, const unsigned char *src,
+	ptrdiff_t ss, unsigned int w, unsigned int h, int n)
 {
-	while (ref_count) {
-		ref_del(ref_head);
-	}	
+	unsigned int tx, ty, ex, ey, by;
+
+	for (ty = 0; ty < h; ty += TILE) {
+		ey = (h - ty < TILE) ? h : ty + TILE;
+		for (tx = 0; tx < w; tx += TILE) {
+			ex = (w - tx < TILE) ? w : tx + TILE;
+			by = ty;
+
+#ifdef __SSE2__
+			by = transpose_blocks(dst,ds,src,ss,tx,ex,ty,ey,n);
+#endif
+			transpose_scalar(dst,ds,src,ss,tx,ex,by,ey,n);
+		}
+	}
 }
 
 
-/* write a bitmap_s struct out to file. the filename is taken from the
-   bitmap_s structs name field. */
-void
-bmp_write(bitmap bmp) 
+/*
+ * copy a scanline of w pixels, n bytes each, from src to dst in reverse
+ * order. with SSE2 (and SSSE3 for 8 bit pixels) 16 bytes are reversed at
+ * a time, working inwards from the end of the source.
+ */
+static void
+mirror_row(unsigned char *dst, const unsigned char *src, unsigned int w,
+	int n)
 {
-	int x = 1;
-	FILE *f;
+	unsigned int x = 0;
+	int k;
 
-	if (!bmp) {
-		return;
+#ifdef __SSE2__
+	if (n == 4 || n == 2
+#ifdef __SSSE3__
+	    || n == 1
+#endif
+	    ) {
+		unsigned int step = 16 / n;
+		__m128i v;
+
+		for (; x + step <= w; x += step) {
+			v = _mm_loadu_si128((const __m128i *)
+				(src + (w - x - step) * n));
+			if (n == 4) {
+				v = _mm_shuffle_epi32(v,0x1B);
+			} else if (n == 2) {
+				v = _mm_shufflelo_epi16(v,0x1B);
+				v = _mm_shufflehi_epi16(v,0x1B);
+				v = _mm_shuffle_epi32(v,0x4E);
+			}
+#ifdef __SSSE3__
+			else {
+				v = _mm_shuffle_epi8(v,_mm_set_epi8(0,1,2,3,
+					4,5,6,7,8,9,10,11,12,13,14,15));
+			}
+#endif
+			_mm_storeu_si128((__m128i *)(dst + x * n),v);
+		}
+	}
+#endif
+
+	for (; x < w; x++) {
+		for (k = 0; k < n; k++) {
+			dst[x * n + k] = src[(w - x - 1) * n + k];
+		}
+	}
+}
+
+
+/*
+ * check that bmp has a bit depth the geometric transforms can handle.
+ */
+static int
+xform_bpp(bitmap_s *bmp)
+{
+	switch (bmp->ih.bpp) {
+	case 8: case 16: case 24: case 32:
+		return 1;
+	}
+	return 0;
+}
+
+
+/*
+ * rotate bmp by a quarter turn into a new bitmap named name, clockwise if
+ * cw is non-zero. the transpose reads the source with its rows reversed for
+ * a clockwise turn, and writes the destination with its rows reversed for
+ * an anticlockwise turn.
+ */
+static bitmap_s *
+rotate(bitmap_s *bmp, const char *name, int cw)
+{
+	bitmap_s *out;
+	unsigned int t;
+	const unsigned char *src;
+	unsigned char *dst;
+	ptrdiff_t ss, ds;
+
+	if (!bmp || !xform_bpp(bmp)) {
+		return NULL;
+	}
+	if (!(out = derive(bmp,name,bmp->ih.h,bmp->ih.w,bmp->ih.bpp))) {
+		return NULL;
+	}
+
+	t = out->ih.hres;
+	out->ih.hres = out->ih.vres;
+	out->ih.vres = t;
+
+	src = bmp->img;
+	ss = bmp->stride;
+	dst = out->img;
+	ds = out->stride;
+	if (cw) {
+		src += (ptrdiff_t)(bmp->ih.h - 1) * ss;
+		ss = -ss;
+	} else {
+		dst += (ptrdiff_t)(out->ih.h - 1) * ds;
+		ds = -ds;
+	}
+	transpose(dst,ds,src,ss,bmp->ih.w,bmp->ih.h,bmp->ih.bpp >> 3);
+
+	return out;
+}
+
+
+/*
+ * copy bmp into a new bitmap named name, mirroring each scanline if fh is
+ * non-zero and reversing the order of the scanlines if fv is non-zero.
+ */
+static bitmap_s *
+flip(bitmap_s *bmp, const char *name, int fh, int fv)
+{
+	bitmap_s *out;
+	unsigned int y, h;
+	unsigned char *dst;
+
+	if (!bmp || !xform_bpp(bmp)) {
+		return NULL;
+	}
+	if (!(out = derive(bmp,name,bmp->ih.w,bmp->ih.h,bmp->ih.bpp))) {
+		return NULL;
+	}
+
+	h = bmp->ih.h;
+	for (y = 0; y < h; y++) {
+		dst = out->img + (fv ? h - y - 1 : y) * out->stride;
+		if (fh) {
+			mirror_row(dst,bmp->img + y * bmp->stride,bmp->ih.w,
+				bmp->ih.bpp >> 3);
+		} else {
+			memcpy(dst,bmp->img + y * bmp->stride,bmp->stride);
+		}
+	}
+
+	return out;
+}
+
+
+/*
+ * plane that holds each byte of a BGR(A) pixel.
+ */
+static const int plane_of[4] = { 2, 1, 0, 3 };
+
+
+/*
+ * size in bytes of one sample of the given type.
+ */
+static size_t
+sample_size(bmp_sample_e type)
+{
+	switch (type) {
+	case BMP_U8:
+		return 1;
+	case BMP_U16:
+		return sizeof(unsigned short);
+	case BMP_F32:
+		return sizeof(float);
+	}
+	return 0;
+}
+
+
+/*
+ * store v as sample x of a plane of the given type.
+ */
+static void
+put_sample(void *plane, unsigned int x, unsigned char v, bmp_sample_e type)
+{
+	switch (type) {
+	case BMP_U8:
+		((unsigned char *)plane)[x] = v;
+		break;
+	case BMP_U16:
+		((unsigned short *)plane)[x] = v;
+		break;
+	case BMP_F32:
+		((float *)plane)[x] = v;
+		break;
+	}
+}
+
+
+/*
+ * fetch sample x of a plane of the given type, rounded and clamped to a
+ * byte.
+ */
+static unsigned char
+get_sample(const void *plane, unsigned int x, bmp_sample_e type)
+{
+	unsigned short u;
+	float f;
+
+	switch (type) {
+	case BMP_U8:
+		return ((const unsigned char *)plane)[x];
+	case BMP_U16:
+		u = ((const unsigned short *)plane)[x];
+		return (u > 255) ? 255 : u;
+	case BMP_F32:
+		f = ((const float *)plane)[x];
+		return (f >= 255.0f) ? 255 : (f > 0.0f) ? (int)(f + 0.5f) : 0;
+	}
+	return 0;
+}
+
+
+#ifdef __SSSE3__
+/*
+ * store the 16 bytes of v as samples x to x+15 of a plane.
+ */
+static void
+put_samples(void *plane, unsigned int x, __m128i v, bmp_sample_e type)
+{
+	__m128i z = _mm_setzero_si128(), lo, hi;
+	float *f;
+
+	switch (type) {
+	case BMP_U8:
+		_mm_storeu_si128((__m128i *)((unsigned char *)plane + x),v);
+		break;
+	case BMP_U16:
+		_mm_storeu_si128((__m128i *)((unsigned short *)plane + x),
+			_mm_unpacklo_epi8(v,z));
+		_mm_storeu_si128((__m128i *)((unsigned short *)plane + x + 8),
+			_mm_unpackhi_epi8(v,z));
+		break;
+	case BMP_F32:
+		f = (float *)plane + x;
+		lo = _mm_unpacklo_epi8(v,z);
+		hi = _mm_unpackhi_epi8(v,z);
+		_mm_storeu_ps(f,_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo,z)));
+		_mm_storeu_ps(f + 4,_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo,z)));
+		_mm_storeu_ps(f + 8,_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi,z)));
+		_mm_storeu_ps(f + 12,_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi,z)));
+		break;
+	}
+}
+
+
+/*
+ * load 4 floats, clamped to 0 to 255 and rounded halves up to match
+ * get_sample.
+ */
+static __m128i
+round_ps(const float *f)
+{
+	__m128 v = _mm_loadu_ps(f);
+
+	v = _mm_min_ps(_mm_max_ps(v,_mm_setzero_ps()),_mm_set1_ps(255.0f));
+	return _mm_cvttps_epi32(_mm_add_ps(v,_mm_set1_ps(0.5f)));
+}
+
+
+/*
+ * fetch samples x to x+15 of a plane, rounded and clamped to bytes.
+ */
+static __m128i
+get_samples(const void *plane, unsigned int x, bmp_sample_e type)
+{
+	const unsigned short *u;
+	const float *f;
+	__m128i lo, hi, ok, ff = _mm_set1_epi16(0xFF), z = _mm_setzero_si128();
+
+	switch (type) {
+	case BMP_U8:
+		break;
+	case BMP_U16:
+		/* any sample with high bits set saturates to 255. packus
+		   alone would treat samples above 32767 as negative. */
+		u = (const unsigned short *)plane + x;
+		lo = _mm_loadu_si128((const __m128i *)u);
+		hi = _mm_loadu_si128((const __m128i *)(u + 8));
+		ok = _mm_cmpeq_epi16(_mm_srli_epi16(lo,8),z);
+		lo = _mm_or_si128(_mm_and_si128(ok,lo),_mm_andnot_si128(ok,ff));
+		ok = _mm_cmpeq_epi16(_mm_srli_epi16(hi,8),z);
+		hi = _mm_or_si128(_mm_and_si128(ok,hi),_mm_andnot_si128(ok,ff));
+		return _mm_packus_epi16(lo,hi);
+	case BMP_F32:
+		f = (const float *)plane + x;
+		lo = _mm_packs_epi32(round_ps(f),round_ps(f + 4));
+		hi = _mm_packs_epi32(round_ps(f + 8),round_ps(f + 12));
+		return _mm_packus_epi16(lo,hi);
+	}
+	return _mm_loadu_si128((const __m128i *)((const unsigned char *)plane
+		+ x));
+}
+#endif
+
+
+/*
+ * split a scanline of w pixels, n bytes each, into the planes. with SSSE3
+ * 16 pixels are loaded into n registers, and each plane is gathered from
+ * them with one byte shuffle per register.
+ */
+static void
+deinterleave_row(void * const *planes, const unsigned char *src,
+	unsigned int w, int n, bmp_sample_e type)
+{
+	unsigned int x = 0;
+	int k;
+
+#ifdef __SSSE3__
+	if (w >= 16) {
+		unsigned char m[16];
+		__m128i mask[4][4], r[4], v;
+		int i, j, b;
+
+		for (k = 0; k < n; k++) {
+			for (i = 0; i < n; i++) {
+				for (j = 0; j < 16; j++) {
+					b = n * j + k - 16 * i;
+					m[j] = (b >= 0 && b < 16) ? b : 0x80;
+				}
+				mask[k][i] = _mm_loadu_si128((const __m128i *)m);
+			}
+		}
+
+		for (; x + 16 <= w; x += 16, src += 16 * n) {
+			for (i = 0; i < n; i++) {
+				r[i] = _mm_loadu_si128((const __m128i *)
+					(src + 16 * i));
+			}
+			for (k = 0; k < n; k++) {
+				v = _mm_shuffle_epi8(r[0],mask[k][0]);
+				for (i = 1; i < n; i++) {
+					v = _mm_or_si128(v,_mm_shuffle_epi8(
+						r[i],mask[k][i]));
+				}
+				put_samples(planes[plane_of[k]],x,v,type);
+			}
+		}
+	}
+#endif
+
+	for (; x < w; x++, src += n) {
+		for (k = 0; k < n; k++) {
+			put_sample(planes[plane_of[k]],x,src[k],type);
+		}
+	}
+}
+
+
+/*
+ * build a scanline of w pixels, n bytes each, from the planes, the reverse
+ * of deinterleave_row. a null plane gives bytes of 0.
+ */
+static void
+interleave_row(unsigned char *dst, void * const *planes, unsigned int w,
+	int n, bmp_sample_e type)
+{
+	unsigned int x = 0;
+	int k;
+
+#ifdef __SSSE3__
+	if (w >= 16) {
+		unsigned char m[16];
+		__m128i mask[4][4], v[4], r;
+		int i, t, b;
+
+		for (i = 0; i < n; i++) {
+			for (k = 0; k < n; k++) {
+				for (t = 0; t < 16; t++) {
+					b = 16 * i + t;
+					m[t] = (b % n == k) ? b / n : 0x80;
+				}
+				mask[i][k] = _mm_loadu_si128((const __m128i *)m);
+			}
+		}
+
+		for (; x + 16 <= w; x += 16, dst += 16 * n) {
+			for (k = 0; k < n; k++) {
+				v[k] = planes[plane_of[k]]
+					? get_samples(planes[plane_of[k]],x,type)
+					: _mm_setzero_si128();
+			}
+			for (i = 0; i < n; i++) {
+				r = _mm_shuffle_epi8(v[0],mask[i][0]);
+				for (k = 1; k < n; k++) {
+					r = _mm_or_si128(r,_mm_shuffle_epi8(
+						v[k],mask[i][k]));
+				}
+				_mm_storeu_si128((__m128i *)(dst + 16 * i),r);
+			}
+		}
+	}
+#endif
+
+	for (; x < w; x++, dst += n) {
+		for (k = 0; k < n; k++) {
+			dst[k] = planes[plane_of[k]]
+				? get_sample(planes[plane_of[k]],x,type) : 0;
+		}
+	}
+}
+
+
+/*
+ * a box of the 15 bit colour histogram used by the median cut. lo and hi
+ * are inclusive bounds on the 5 bit blue, green and red axes.
+ */
+struct box_s {
+	int lo[3], hi[3];
+	unsigned long count;
+};
+
+
+/*
+ * index of a 5 bit per channel colour in the histogram.
+ */
+#define HIST_IDX(b, g, r)	(((r) << 10) | ((g) << 5) | (b))
+
+
+/*
+ * shrink a box to the bins that are actually used, counting the samples
+ * it holds on the way.
+ */
+static void
+box_fit(struct box_s *box, const unsigned long *hist)
+{
+	int lo[3] = { 31, 31, 31 }, hi[3] = { 0, 0, 0 }, c[3], k;
+
+	box->count = 0;
+	for (c[2] = box->lo[2]; c[2] <= box->hi[2]; c[2]++)
+	for (c[1] = box->lo[1]; c[1] <= box->hi[1]; c[1]++)
+	for (c[0] = box->lo[0]; c[0] <= box->hi[0]; c[0]++) {
+		if (hist[HIST_IDX(c[0],c[1],c[2])]) {
+			box->count += hist[HIST_IDX(c[0],c[1],c[2])];
+			for (k = 0; k < 3; k++) {
+				lo[k] = (c[k] < lo[k]) ? c[k] : lo[k];
+				hi[k] = (c[k] > hi[k]) ? c[k] : hi[k];
+			}
+		}
+	}
+	if (box->count) {
+		memcpy(box->lo,lo,sizeof lo);
+		memcpy(box->hi,hi,sizeof hi);
+	}
+}
+
+
+/*
+ * split box along its longest axis at the median sample, putting the
+ * upper half in out. both halves are left holding at least one bin.
+ */
+static void
+box_split(struct box_s *box, struct box_s *out, const unsigned long *hist)
+{
+	int a = 0, k, c[3], cut;
+	unsigned long slice[32], sum = 0;
+
+	for (k = 1; k < 3; k++) {
+		if (box->hi[k] - box->lo[k] > box->hi[a] - box->lo[a]) {
+			a = k;
+		}
+	}
+
+	memset(slice,0,sizeof slice);
+	for (c[2] = box->lo[2]; c[2] <= box->hi[2]; c[2]++)
+	for (c[1] = box->lo[1]; c[1] <= box->hi[1]; c[1]++)
+	for (c[0] = box->lo[0]; c[0] <= box->hi[0]; c[0]++) {
+		slice[c[a]] += hist[HIST_IDX(c[0],c[1],c[2])];
+	}
+
+	/* walk slices along the axis until half the samples are behind. */
+	for (cut = box->lo[a]; cut < box->hi[a] - 1; cut++) {
+		sum += slice[cut];
+		if (sum >= box->count / 2) {
+			break;
+		}
+	}
+
+	*out = *box;
+	box->hi[a] = cut;
+	out->lo[a] = cut + 1;
+	box_fit(box,hist);
+	box_fit(out,hist);
+}
+
+
+/*
+ * build a palette of at most colors entries, in BGRX order, by median cut
+ * over a 15 bit histogram of a sample of the pixels of bmp. about 2^18
+ * pixels are sampled, spread evenly through the image. returns the number
+ * of entries used.
+ */
+static int
+median_cut(bitmap_s *bmp, unsigned char *pal, int colors)
+{
+	unsigned long *hist, sum[3];
+	struct box_s box[256];
+	size_t total, step, i;
+	const unsigned char *p;
+	int n = 1, best, b, k, c[3];
+
+	if (!(hist = calloc(32768,sizeof *hist))) {
+		fatal("memory exhausted");
+	}
+
+	total = (size_t)bmp->ih.w * bmp->ih.h;
+	step = total / 262144 + 1;
+	for (i = 0; i < total; i += step) {
+		p = bmp->img + i / bmp->ih.w * bmp->stride + i % bmp->ih.w * 3;
+		hist[HIST_IDX(p[0] >> 3,p[1] >> 3,p[2] >> 3)]++;
+	}
+
+	for (k = 0; k < 3; k++) {
+		box[0].lo[k] = 0;
+		box[0].hi[k] = 31;
+	}
+	box_fit(&box[0],hist);
+
+	/* always split the most populated box that still can be. */
+	while (n < colors) {
+		for (best = -1, b = 0; b < n; b++) {
+			if ((box[b].hi[0] > box[b].lo[0]
+			     || box[b].hi[1] > box[b].lo[1]
+			     || box[b].hi[2] > box[b].lo[2])
+			    && (best < 0 || box[b].count > box[best].count)) {
+				best = b;
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+		box_split(&box[best],&box[n++],hist);
+	}
+
+	/* each entry is the mean of the samples in its box. */
+	for (b = 0; b < n; b++) {
+		sum[0] = sum[1] = sum[2] = 0;
+		for (c[2] = box[b].lo[2]; c[2] <= box[b].hi[2]; c[2]++)
+		for (c[1] = box[b].lo[1]; c[1] <= box[b].hi[1]; c[1]++)
+		for (c[0] = box[b].lo[0]; c[0] <= box[b].hi[0]; c[0]++) {
+			for (k = 0; k < 3; k++) {
+				sum[k] += hist[HIST_IDX(c[0],c[1],c[2])]
+					* ((c[k] << 3) | 4);
+			}
+		}
+		for (k = 0; k < 3; k++) {
+			pal[b * 4 + k] = box[b].count
+				? sum[k] / box[b].count : (box[b].lo[k] << 3) | 4;
+		}
+		pal[b * 4 + 3] = 0;
+	}
+
+	free(hist);
+	return n;
+}
+
+
+/*
+ * palette held one channel per array for the nearest colour search, padded
+ * to a multiple of 8 entries by repeating the last, which can never win
+ * over the original since ties go to the lowest index.
+ */
+struct pal_s {
+	short c[3][256];
+	int n;
+};
+
+
+/*
+ * index of the palette entry nearest to the colour b, g, r by squared
+ * euclidean distance, the lowest index on a tie. with SSE2, 8 entries are
+ * compared per step using 16 bit differences squared and summed into 32
+ * bits by madd, keeping the best distance and index in each lane.
+ */
+static int
+nearest(const struct pal_s *pal, int b, int g, int r)
+{
+	int i, best = 0;
+	long bd = 0x7FFFFFFFL;
+
+#ifdef __SSE2__
+	__m128i vb = _mm_set1_epi16(b), vg = _mm_set1_epi16(g);
+	__m128i vr = _mm_set1_epi16(r), z = _mm_setzero_si128();
+	__m128i bdl = _mm_set1_epi32(0x7FFFFFFF), bdh = bdl;
+	__m128i bil = z, bih = z, il = _mm_set_epi32(3,2,1,0);
+	__m128i ih = _mm_set_epi32(7,6,5,4), eight = _mm_set1_epi32(8);
+	int dist[8], idx[8];
+
+	for (i = 0; i < pal->n; i += 8) {
+		__m128i db = _mm_sub_epi16(_mm_loadu_si128(
+			(const __m128i *)&pal->c[0][i]),vb);
+		__m128i dg = _mm_sub_epi16(_mm_loadu_si128(
+			(const __m128i *)&pal->c[1][i]),vg);
+		__m128i dr = _mm_sub_epi16(_mm_loadu_si128(
+			(const __m128i *)&pal->c[2][i]),vr);
+		__m128i t, dl, dh, lt;
+
+		t  = _mm_unpacklo_epi16(db,dg);
+		dl = _mm_madd_epi16(t,t);
+		t  = _mm_unpacklo_epi16(dr,z);
+		dl = _mm_add_epi32(dl,_mm_madd_epi16(t,t));
+		t  = _mm_unpackhi_epi16(db,dg);
+		dh = _mm_madd_epi16(t,t);
+		t  = _mm_unpackhi_epi16(dr,z);
+		dh = _mm_add_epi32(dh,_mm_madd_epi16(t,t));
+
+		lt  = _mm_cmplt_epi32(dl,bdl);
+		bdl = _mm_or_si128(_mm_and_si128(lt,dl),_mm_andnot_si128(lt,bdl));
+		bil = _mm_or_si128(_mm_and_si128(lt,il),_mm_andnot_si128(lt,bil));
+		lt  = _mm_cmplt_epi32(dh,bdh);
+		bdh = _mm_or_si128(_mm_and_si128(lt,dh),_mm_andnot_si128(lt,bdh));
+		bih = _mm_or_si128(_mm_and_si128(lt,ih),_mm_andnot_si128(lt,bih));
+
+		il = _mm_add_epi32(il,eight);
+		ih = _mm_add_epi32(ih,eight);
+	}
+
+	_mm_storeu_si128((__m128i *)dist,bdl);
+	_mm_storeu_si128((__m128i *)(dist + 4),bdh);
+	_mm_storeu_si128((__m128i *)idx,bil);
+	_mm_storeu_si128((__m128i *)(idx + 4),bih);
+	for (i = 0; i < 8; i++) {
+		if (dist[i] < bd || (dist[i] == bd && idx[i] < best)) {
+			bd = dist[i];
+			best = idx[i];
+		}
+	}
+#else
+	long d;
+
+	for (i = 0; i < pal->n; i++) {
+		d = (long)(pal->c[0][i] - b) * (pal->c[0][i] - b)
+			+ (long)(pal->c[1][i] - g) * (pal->c[1][i] - g)
+			+ (long)(pal->c[2][i] - r) * (pal->c[2][i] - r);
+		if (d < bd) {
+			bd = d;
+			best = i;
+		}
+	}
+#endif
+
+	return best;
+}
+
+
+/*
+ * accumulate the differences between len bytes at a and b into the
+ * running totals, and clear *equal if any byte differs. with SSE2, 16
+ * bytes are compared per step: sad sums absolute differences, and madd
+ * squares and pairs them up in 32 bit lanes. the lanes are flushed to the
+ * totals every 4096 steps, well before they can overflow.
+ */
+static void
+compare_row(const unsigned char *a, const unsigned char *b, size_t len,
+	int *equal, double *abs_sum, double *sq_sum)
+{
+	size_t i = 0;
+	int d;
+
+#ifdef __SSE2__
+	__m128i z = _mm_setzero_si128();
+
+	while (i + 16 <= len) {
+		__m128i sad = z, sq = z, ne = z, va, vb, ad, lo, hi;
+		unsigned int lane[4];
+		size_t end = i + 16 * 4096;
+
+		if (end > len) {
+			end = len;
+		}
+		for (; i + 16 <= end; i += 16) {
+			va = _mm_loadu_si128((const __m128i *)(a + i));
+			vb = _mm_loadu_si128((const __m128i *)(b + i));
+			ad = _mm_or_si128(_mm_subs_epu8(va,vb),
+				_mm_subs_epu8(vb,va));
+			ne = _mm_or_si128(ne,ad);
+			sad = _mm_add_epi64(sad,_mm_sad_epu8(va,vb));
+			lo = _mm_unpacklo_epi8(ad,z);
+			hi = _mm_unpackhi_epi8(ad,z);
+			sq = _mm_add_epi32(sq,_mm_add_epi32(_mm_madd_epi16(lo,lo),
+				_mm_madd_epi16(hi,hi)));
+		}
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(ne,z)) != 0xFFFF) {
+			*equal = 0;
+		}
+		*abs_sum += (unsigned int)_mm_cvtsi128_si32(sad);
+		*abs_sum += (unsigned int)_mm_cvtsi128_si32(
+			_mm_srli_si128(sad,8));
+		_mm_storeu_si128((__m128i *)lane,sq);
+		*sq_sum += (double)lane[0] + lane[1] + lane[2] + lane[3];
+	}
+#endif
+
+	for (; i < len; i++) {
+		d = (a[i] > b[i]) ? a[i] - b[i] : b[i] - a[i];
+		if (d) {
+			*equal = 0;
+			*abs_sum += d;
+			*sq_sum += d * d;
+		}
+	}
+}
+
+
+/*
+ * bytes of pixel data in each scanline of bmp, without padding. images of
+ * less than 8 bits per pixel may only partly use the last of these bytes,
+ * so *mask is set to the bits of it that hold pixels, which are packed from
+ * the most significant bit down.
+ */
+static size_t
+row_data(bitmap_s *bmp, unsigned char *mask)
+{
+	size_t bits = (size_t)bmp->ih.w * bmp->ih.bpp;
+
+	*mask = (bits & 7) ? (0xFF << (8 - (bits & 7))) & 0xFF : 0xFF;
+	return (bits + 7) >> 3;
+}
+
+
+/*
+ * start a new xxHash32 digest.
+ */
+static void
+xxh_init(struct xxh_s *st, unsigned int seed)
+{
+	st->v[0] = seed + XXH_P1 + XXH_P2;
+	st->v[1] = seed + XXH_P2;
+	st->v[2] = seed;
+	st->v[3] = seed - XXH_P1;
+	st->len = 0;
+	st->large = 0;
+	st->used = 0;
+	st->seed = seed;
+}
+
+
+/*
+ * little endian 32 bit word at p.
+ */
+static unsigned int
+read32(const unsigned char *p)
+{
+	return (unsigned int)p[0] | (unsigned int)p[1] << 8
+		| (unsigned int)p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+
+#ifdef __SSE2__
+/*
+ * multiply 32 bit lanes, keeping the low halves. without SSE4.1 only even
+ * lanes can be multiplied into 64 bits, so odd lanes are shifted down and
+ * done again.
+ */
+static __m128i
+mullo32(__m128i a, __m128i b)
+{
+#ifdef __SSE4_1__
+	return _mm_mullo_epi32(a,b);
+#else
+	__m128i even = _mm_mul_epu32(a,b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a,32),_mm_srli_epi64(b,32));
+
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even,0x08),
+		_mm_shuffle_epi32(odd,0x08));
+#endif
+}
+#endif
+
+
+/*
+ * feed whole 16 byte stripes into the accumulators, returning the number
+ * of bytes consumed. with SSE2 the four accumulators are kept in one
+ * register and each stripe is a single vector round.
+ */
+static size_t
+xxh_stripes(struct xxh_s *st, const unsigned char *p, size_t len)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	__m128i v = _mm_loadu_si128((const __m128i *)st->v);
+	__m128i p1 = _mm_set1_epi32((int)XXH_P1);
+	__m128i p2 = _mm_set1_epi32((int)XXH_P2);
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_add_epi32(v,mullo32(
+			_mm_loadu_si128((const __m128i *)(p + i)),p2));
+		v = _mm_or_si128(_mm_slli_epi32(v,13),_mm_srli_epi32(v,19));
+		v = mullo32(v,p1);
+	}
+	_mm_storeu_si128((__m128i *)st->v,v);
+#else
+	int k;
+
+	for (; i + 16 <= len; i += 16) {
+		for (k = 0; k < 4; k++) {
+			st->v[k] += read32(p + i + 4 * k) * XXH_P2;
+			st->v[k] = XXH_ROTL(st->v[k],13) * XXH_P1;
+		}
+	}
+#endif
+
+	return i;
+}
+
+
+/*
+ * hash len more bytes at p.
+ */
+static void
+xxh_update(struct xxh_s *st, const unsigned char *p, size_t len)
+{
+	size_t n;
+
+	st->len += (unsigned int)len;
+	if (st->used + len >= 16) {
+		st->large = 1;
+	}
+
+	if (st->used) {
+		n = 16 - st->used;
+		if (len < n) {
+			memcpy(st->buf + st->used,p,len);
+			st->used += len;
+			return;
+		}
+		memcpy(st->buf + st->used,p,n);
+		xxh_stripes(st,st->buf,16);
+		st->used = 0;
+		p += n;
+		len -= n;
+	}
+
+	n = xxh_stripes(st,p,len);
+	memcpy(st->buf,p + n,len - n);
+	st->used = len - n;
+}
+
+
+/*
+ * finish a digest, mixing in the bytes left over from the last stripe.
+ */
+static unsigned int
+xxh_digest(struct xxh_s *st)
+{
+	unsigned int h;
+	int i = 0;
+
+	if (st->large) {
+		h = XXH_ROTL(st->v[0],1) + XXH_ROTL(st->v[1],7)
+			+ XXH_ROTL(st->v[2],12) + XXH_ROTL(st->v[3],18);
+	} else {
+		h = st->seed + XXH_P5;
+	}
+	h += st->len;
+
+	for (; i + 4 <= st->used; i += 4) {
+		h += read32(st->buf + i) * XXH_P3;
+		h = XXH_ROTL(h,17) * XXH_P4;
+	}
+	for (; i < st->used; i++) {
+		h += st->buf[i] * XXH_P5;
+		h = XXH_ROTL(h,11) * XXH_P1;
+	}
+
+	h ^= h >> 15;
+	h *= XXH_P2;
+	h ^= h >> 13;
+	h *= XXH_P3;
+	h ^= h >> 16;
+
+	return h;
+}
+
+
+/*
+ * store v at p as a little endian 32 bit word.
+ */
+static void
+put32(unsigned char *p, unsigned int v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = (v >> 24) & 0xFF;
+}
+
+
+/*
+ * store a file offset at p as low then high 32 bit words.
+ */
+static void
+put_off(unsigned char *p, off_t off)
+{
+	put32(p,(unsigned int)(off & 0xFFFFFFFFUL));
+	put32(p + 4,(unsigned int)(off >> 16 >> 16));
+}
+
+
+/*
+ * read an offset stored by put_off. returns 0 if it can't be held in a
+ * size_t, which only happens with archives over 4GB on 32 bit hosts.
+ */
+static int
+get_off(const unsigned char *p, size_t *off)
+{
+	unsigned int hi = read32(p + 4);
+
+	if (hi && sizeof(size_t) <= 4) {
+		return 0;
+	}
+	*off = (size_t)hi << 16 << 16 | read32(p);
+	return 1;
+}
+
+
+/*
+ * check that len bytes from off lie inside the archive.
+ */
+static int
+pack_span(struct pack_s *p, size_t off, size_t len)
+{
+	return (off <= p->size && len <= p->size - off);
+}
+
+
+/*
+ * name of image id in the archive, setting *len to its length. returns
+ * NULL if the index entry points outside the name table.
+ */
+static const unsigned char *
+pack_name(struct pack_s *p, unsigned int id, size_t *len)
+{
+	const unsigned char *r = p->index + (size_t)id * PACK_REC;
+	size_t off = read32(r);
+
+	*len = read32(r + 4);
+	if (off > p->names_size || *len > p->names_size - off) {
+		return NULL;
+	}
+	return p->names + off;
+}
+
+
+/*
+ * order bitmaps by name for qsort, matching the byte order in which
+ * bmp_pack_find compares names.
+ */
+static int
+pack_order(const void *a, const void *b)
+{
+	return strcmp((*(const bitmap *)a)->name,(*(const bitmap *)b)->name);
+}
+
+
+/*---------------- BEGIN PUBLIC INTERFACE ----------------
+ *
+ * these functions are well documented in the header file.
+ * please refer to bmp.h for verbose details.
+ *
+ */
+
+
+/* return pointer to image, NULL on error. */
+void *
+bmp_get_img(bitmap bmp)
+{
+	if (ref_exists(bmp)) {
+		return bmp->img;
+	}
+	return NULL;
+}	
+
+
+/* returns an initialised and validated bitmap_s struct, NULL on error.  */
+bitmap 
+bmp_load(const char *fname)
+{
+	FILE *f;
+	int error = 1;
+	bitmap_s *bmp = NULL;
+		
+	if (!(f = fopen(fname,"rb"))) {
+		warn("failed to open",fname);
+	} else if (!(bmp = init(fname))) {
+		fatal("Memory exhausted");
+	} else if (!get_fh(bmp,f)) {
+		warn("invalid image file",fname);
+	} else if (!get_ih(bmp,f)) {
+		warn("image header corrupt",fname);
+	} else if (!get_pal(bmp,f)) {
+		warn("palette corrupt",fname);
+	} else if (!get_dib(bmp,f)) {
+		warn("image data corrupt",fname);
+	} else {	
+		fclose(f);
+		error = 0;
+	}	
+	
+	if (error) {
+		bmp = bmp_destroy(bmp);
+	}	
+	
+	return (bitmap)bmp;
+}
+
+
+/* returns an initialised bitmap_s struct with pixels in the given channel
+   order, NULL on error. */
+bitmap
+bmp_load_order(const char *fname, bmp_order_e order, unsigned char alpha)
+{
+	FILE *f;
+	int error = 1;
+	bitmap_s *bmp = NULL;
+
+	if (!(f = fopen(fname,"rb"))) {
+		warn("failed to open",fname);
+	} else if (!(bmp = init(fname))) {
+		fatal("Memory exhausted");
+	} else if (!get_fh(bmp,f)) {
+		warn("invalid image file",fname);
+	} else if (!get_ih(bmp,f)) {
+		warn("image header corrupt",fname);
+	} else if ((bmp->ih.bpp != 24 && bmp->ih.bpp != 32)
+		   || !order_bpp(order)) {
+		warn("unsupported channel conversion",fname);
+	} else if (!get_dib_order(bmp,f,order,alpha)) {
+		warn("image data corrupt",fname);
+	} else {
+		error = 0;
+	}
+
+	if (f) {
+		fclose(f);
+	}
+	if (error) {
+		bmp = bmp_destroy(bmp);
+	}
+
+	return (bitmap)bmp;
+}
+
+
+/* return image width from valid bitmap_s struct. */
+int
+bmp_get_width(bitmap bmp)
+{
+	return bmp->ih.w;
+}
+
+
+/* return image height from valid bitmap_s struct. */
+int
+bmp_get_height(bitmap bmp)
+{
+	return bmp->ih.h;
+}
+
+
+/* return scanline stride from valid bitmap_s struct. */
+size_t
+bmp_get_stride(bitmap bmp)
+{
+	return bmp->stride;
+}
+
+
+/* returns a new bitmap_s struct with pixels in the given channel order,
+   converted from a 24 or 32 bit bitmap_s struct. name is the new filename
+   for the image. */
+bitmap
+bmp_convert_order(bitmap bmp, char *name, bmp_order_e order,
+	unsigned char alpha)
+{
+	bitmap_s *out;
+	unsigned int y;
+
+	if (!bmp || (bmp->ih.bpp != 24 && bmp->ih.bpp != 32)
+	    || !order_bpp(order)) {
+		return NULL;
+	}
+
+	if (!(out = derive(bmp,name,bmp->ih.w,bmp->ih.h,order_bpp(order)))) {
+		return NULL;
+	}
+
+	for (y = 0; y < bmp->ih.h; y++) {
+		swizzle_row(out->img + y * out->stride,bmp->img + y * bmp->stride,
+			bmp->ih.w,bmp->ih.bpp >> 3,order,alpha);
+	}
+
+	return (bitmap)out;
+}
+
+
+/* returns a new bitmap_s stuct containing a 32 bit image, converted from 
+   given bitmap_s struct containing 24 bit image. name is the new filename
+   for the image. */
+bitmap
+bmp_convert24to32(bitmap bmp24, char *name)
+{
+	if (!bmp24 || bmp24->ih.bpp != 24) {
+		return NULL;
+	}
+	return bmp_convert_order(bmp24,name,BMP_BGRA,0);
+}
+
+
+/* returns a new bitmap_s struct containing an 8 bit palettised image,
+   converted from given bitmap_s struct containing 24 bit image. name is the
+   new filename for the image. */
+bitmap
+bmp_convert24to8(bitmap bmp24, char *name, int colors, int cache)
+{
+	bitmap_s *bmp8;
+	struct pal_s pal;
+	unsigned short *inv = NULL;
+	const unsigned char *src;
+	unsigned char *dst;
+	unsigned int x, y, key;
+	int n, i, k;
+
+	if (!bmp24 || bmp24->ih.bpp != 24 || colors < 2 || colors > 256) {
+		return NULL;
+	}
+
+	if (!(bmp8 = derive(bmp24,name,bmp24->ih.w,bmp24->ih.h,8))) {
+		return NULL;
+	}
+	if (!(bmp8->palette = malloc(1024))) {
+		fatal("memory exhausted");
+	}
+	n = median_cut(bmp24,bmp8->palette,colors);
+
+	/* the palette follows a plain 40 byte info header. */
+	bmp8->ih.ih_size = 40;
+	bmp8->ih.compress = 0;
+	bmp8->ih.num_colors = n;
+	bmp8->ih.num_important = 0;
+	bmp8->fh.dib_offset = 54 + 4 * n;
+	set_size(bmp8,8);
+
+	for (i = 0; i < 256; i++) {
+		for (k = 0; k < 3; k++) {
+			pal.c[k][i] = bmp8->palette[(i < n ? i : n - 1) * 4 + k];
+		}
+	}
+	pal.n = (n + 7) & ~7;
+
+	/* the inverse colour map caches the nearest entry to the centre of
+	   each 15 bit colour, filled in as colours are first seen. */
+	if (cache) {
+		if (!(inv = malloc(32768 * sizeof *inv))) {
+			fatal("memory exhausted");
+		}
+		memset(inv,0xFF,32768 * sizeof *inv);
+	}
+
+	for (y = 0; y < bmp24->ih.h; y++) {
+		src = bmp24->img + y * bmp24->stride;
+		dst = bmp8->img + y * bmp8->stride;
+		for (x = 0; x < bmp24->ih.w; x++, src += 3) {
+			if (!inv) {
+				dst[x] = nearest(&pal,src[0],src[1],src[2]);
+				continue;
+			}
+			key = HIST_IDX(src[0] >> 3,src[1] >> 3,src[2] >> 3);
+			if (inv[key] == 0xFFFF) {
+				inv[key] = nearest(&pal,(src[0] & 0xF8) | 4,
+					(src[1] & 0xF8) | 4,(src[2] & 0xF8) | 4);
+			}
+			dst[x] = inv[key];
+		}
+	}
+	free(inv);
+
+	return (bitmap)bmp8;
+}
+
+
+/* returns a new bitmap_s stuct containing a 16 bit image, converted from 
+   given bitmap_s struct containing 24 bit image. name is the new filename
+   for the image. */
+bitmap 
+bmp_convert24to16(bitmap bmp24, char *name)
+{
+	bitmap_s *bmp16;
+	unsigned char *src, *dst;
+	unsigned int x, y, v;
+
+	if (!bmp24 || bmp24->ih.bpp != 24) {
+		return NULL;
+	}
+
+	if (!(bmp16 = derive(bmp24,name,bmp24->ih.w,bmp24->ih.h,16))) {
+		return NULL;
+	}
+
+	for (y = 0; y < bmp24->ih.h; y++) {
+		src = bmp24->img + y * bmp24->stride;
+		dst = bmp16->img + y * bmp16->stride;
+		for (x = 0; x < bmp24->ih.w; x++, src += 3, dst += 2) {
+			v = (src[0]&0xF8)>>3 | (src[1]&0xFC)<<3
+				| (src[2]&0xF8)<<8;
+
+			/* stored little endian, as in the file. */
+			dst[0] = v & 0xFF;
+			dst[1] = v >> 8;
+		}
+	}
+
+        return (bitmap)bmp16;
+}
+
+
+/* returns a new bitmap_s struct rotated a quarter turn clockwise. */
+bitmap
+bmp_rotate90(bitmap bmp, char *name)
+{
+	return (bitmap)rotate(bmp,name,1);
+}
+
+
+/* returns a new bitmap_s struct rotated a half turn. */
+bitmap
+bmp_rotate180(bitmap bmp, char *name)
+{
+	return (bitmap)flip(bmp,name,1,1);
+}
+
+
+/* returns a new bitmap_s struct rotated a quarter turn anticlockwise. */
+bitmap
+bmp_rotate270(bitmap bmp, char *name)
+{
+	return (bitmap)rotate(bmp,name,0);
+}
+
+
+/* returns a new bitmap_s struct mirrored left to right. */
+bitmap
+bmp_flip_h(bitmap bmp, char *name)
+{
+	return (bitmap)flip(bmp,name,1,0);
+}
+
+
+/* returns a new bitmap_s struct mirrored top to bottom. */
+bitmap
+bmp_flip_v(bitmap bmp, char *name)
+{
+	return (bitmap)flip(bmp,name,0,1);
+}
+
+
+/* returns newly allocated planes split from a 24 or 32 bit bitmap_s struct,
+   NULL on error. */
+planar
+bmp_to_planar(bitmap bmp, bmp_sample_e type, size_t align)
+{
+	planar_s *pl;
+	size_t row, bytes, max = (size_t)-1;
+	unsigned char *p;
+	void *planes[4];
+	unsigned int y;
+	int n, k;
+
+	if (!bmp || (bmp->ih.bpp != 24 && bmp->ih.bpp != 32)
+	    || !sample_size(type) || (align & (align - 1))) {
+		return NULL;
+	}
+	n = bmp->ih.bpp >> 3;
+	if (!align) {
+		align = 1;
+	}
+
+	/* each row, and so each plane, is a multiple of align bytes. */
+	if (bmp->ih.w > (max - align) / sample_size(type)) {
+		warn("image too large",bmp->name);
+		return NULL;
+	}
+	row = (bmp->ih.w * sample_size(type) + align - 1) & ~(align - 1);
+	if (row > (max - align) / bmp->ih.h / n) {
+		warn("image too large",bmp->name);
+		return NULL;
+	}
+	bytes = row * bmp->ih.h;
+
+	if (!(pl = malloc(sizeof *pl))
+	    || !(pl->mem = malloc(bytes * n + align - 1))) {
+		fatal("memory exhausted");
+	}
+	pl->w = bmp->ih.w;
+	pl->h = bmp->ih.h;
+	pl->channels = n;
+	pl->type = type;
+	pl->pitch = row;
+
+	p = (unsigned char *)pl->mem;
+	p += (align - (size_t)p % align) % align;
+	for (k = 0; k < 4; k++) {
+		pl->plane[k] = (k < n) ? p + k * bytes : NULL;
+	}
+
+	for (y = 0; y < pl->h; y++) {
+		for (k = 0; k < n; k++) {
+			planes[k] = (unsigned char *)pl->plane[k] + y * row;
+		}
+		deinterleave_row(planes,bmp->img + y * bmp->stride,pl->w,n,type);
+	}
+
+	return (planar)pl;
+}
+
+
+/* returns a new 24 or 32 bit bitmap_s struct built from the given planes,
+   NULL on error. */
+bitmap
+bmp_from_planar(planar pl, char *name, int bpp)
+{
+	bitmap_s *bmp;
+	void *planes[4];
+	unsigned int y;
+	int n, k;
+
+	if (!pl || (bpp != 24 && bpp != 32) || !sample_size(pl->type)
+	    || pl->channels < 3 || pl->channels > 4) {
+		return NULL;
+	}
+	n = bpp >> 3;
+
+	if (!(bmp = init(name))) {
+		fatal("memory exhausted");
+	}
+
+	/* a fresh BI_RGB header, as written by most applications. */
+	memcpy(bmp->fh.signature,"BM",2);
+	bmp->fh.reserved = 0;
+	bmp->fh.dib_offset = 54;
+	bmp->ih.ih_size = 40;
+	bmp->ih.w = pl->w;
+	bmp->ih.h = pl->h;
+	bmp->ih.planes = 1;
+	bmp->ih.compress = 0;
+	bmp->ih.hres = 2835;
+	bmp->ih.vres = 2835;
+	bmp->ih.num_colors = 0;
+	bmp->ih.num_important = 0;
+
+	if (!set_size(bmp,bpp)) {
+		warn("image too large",name);
+		return bmp_destroy(bmp);
+	}
+	if (!(bmp->img = malloc(bmp->img_bytes))) {
+		fatal("memory exhausted");
+	}
+
+	for (y = 0; y < pl->h; y++) {
+		for (k = 0; k < 4; k++) {
+			planes[k] = (k < pl->channels) ? (unsigned char *)
+				pl->plane[k] + y * pl->pitch : NULL;
+		}
+		interleave_row(bmp->img + y * bmp->stride,planes,pl->w,n,
+			pl->type);
+	}
+
+	return (bitmap)bmp;
+}
+
+
+/* free planes allocated by bmp_to_planar. */
+void *
+bmp_planar_destroy(planar pl)
+{
+	if (pl) {
+		free(pl->mem);
+		free(pl);
+	}
+	return NULL;
+}
+
+
+/* compare the pixel data of two bitmap_s structs of the same shape. */
+int
+bmp_compare(bitmap a, bitmap b, compare_s *res)
+{
+	double abs_sum = 0, sq_sum = 0, total;
+	const unsigned char *pa, *pb;
+	unsigned char mask, ta, tb;
+	size_t len, full;
+	unsigned int y;
+	int equal = 1;
+
+	if (!a || !b || a->ih.w != b->ih.w || a->ih.h != b->ih.h
+	    || a->ih.bpp != b->ih.bpp) {
+		return 0;
+	}
+
+	/* a partly used last byte is compared without its padding bits. */
+	len = row_data(a,&mask);
+	full = (mask == 0xFF) ? len : len - 1;
+	for (y = 0; y < a->ih.h; y++) {
+		pa = a->img + y * a->stride;
+		pb = b->img + y * b->stride;
+		compare_row(pa,pb,full,&equal,&abs_sum,&sq_sum);
+		if (full < len) {
+			ta = pa[full] & mask;
+			tb = pb[full] & mask;
+			compare_row(&ta,&tb,1,&equal,&abs_sum,&sq_sum);
+		}
+	}
+
+	total = (double)len * a->ih.h;
+	res->equal = equal;
+	res->mae = abs_sum / total;
+	res->mse = sq_sum / total;
+	res->psnr = equal ? HUGE_VAL : 10.0 * log10(255.0 * 255.0 / res->mse);
+
+	return 1;
+}
+
+
+/* return the xxHash32 digest of the pixel data of a bitmap_s struct. */
+unsigned int
+bmp_hash(bitmap bmp, unsigned int seed)
+{
+	struct xxh_s st;
+	const unsigned char *p;
+	unsigned char mask, t;
+	size_t len, full;
+	unsigned int y;
+
+	if (!bmp) {
+		return 0;
+	}
+
+	/* a partly used last byte is hashed with its padding bits clear. */
+	xxh_init(&st,seed);
+	len = row_data(bmp,&mask);
+	full = (mask == 0xFF) ? len : len - 1;
+	for (y = 0; y < bmp->ih.h; y++) {
+		p = bmp->img + y * bmp->stride;
+		xxh_update(&st,p,full);
+		if (full < len) {
+			t = p[full] & mask;
+			xxh_update(&st,&t,1);
+		}
+	}
+
+	return xxh_digest(&st);
+}
+
+
+/* count the values of each byte of the pixels of a bitmap_s struct. */
+int
+bmp_histogram(bitmap bmp, unsigned long hist[][256])
+{
+	/* four copies of each table, used in turn by consecutive pixels, so
+	   runs of the same value don't stall on the previous increment. */
+	unsigned long (*part)[4][256];
+	const unsigned char *p;
+	unsigned int x, y;
+	int n, k, c, v;
+
+	if (!bmp || (bmp->ih.bpp != 8 && bmp->ih.bpp != 24
+		     && bmp->ih.bpp != 32)) {
+		return 0;
+	}
+	n = bmp->ih.bpp >> 3;
+
+	if (!(part = calloc(4,sizeof *part))) {
+		fatal("memory exhausted");
+	}
+
+	for (y = 0; y < bmp->ih.h; y++) {
+		p = bmp->img + y * bmp->stride;
+		for (x = 0; x < bmp->ih.w; x++, p += n) {
+			for (k = 0; k < n; k++) {
+				part[x & 3][k][p[k]]++;
+			}
+		}
+	}
+
+	for (k = 0; k < n; k++) {
+		for (v = 0; v < 256; v++) {
+			hist[k][v] = 0;
+			for (c = 0; c < 4; c++) {
+				hist[k][v] += part[c][k][v];
+			}
+		}
+	}
+	free(part);
+
+	return n;
+}
+
+
+/* pack bitmap_s structs into a single archive file, indexed by name. */
+int
+bmp_pack_write(const char *fname, bitmap *bmps, int n)
+{
+	FILE *f;
+	bitmap *sorted;
+	off_t *at, pos;
+	unsigned char rec[PACK_HDR];
+	unsigned long names = 0;
+	size_t pal;
+	int i, ok = 1;
+
+	if (!bmps || n < 0) {
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		if (!bmps[i] || !bmps[i]->img) {
+			warn("can't pack an empty bitmap",fname);
+			return 0;
+		}
+	}
+
+	if (!(sorted = malloc((n + 1) * sizeof *sorted))
+	    || !(at = malloc((n + 1) * sizeof *at))) {
+		fatal("memory exhausted");
+	}
+	memcpy(sorted,bmps,n * sizeof *sorted);
+	qsort(sorted,n,sizeof *sorted,pack_order);
+
+	for (i = 0; i < n; i++) {
+		if (i && strcmp(sorted[i - 1]->name,sorted[i]->name) == 0) {
+			warn("duplicate name in archive",sorted[i]->name);
+			ok = 0;
+		}
+		names += strlen(sorted[i]->name);
+	}
+	if (!ok || names > 0xFFFFFFFFUL) {
+		free(sorted);
+		free(at);
+		return 0;
+	}
+
+	if (!(f = fopen(fname,"wb"))) {
+		warn("Failed to open file",fname);
+		free(sorted);
+		free(at);
+		return 0;
+	}
+
+	/* lay out the images after the index and names. */
+	pos = PACK_HDR + (off_t)n * PACK_REC + names;
+	for (i = 0; i < n; i++) {
+		pos = (pos + PACK_ALIGN - 1) & ~(off_t)(PACK_ALIGN - 1);
+		at[i] = pos;
+		pal = sorted[i]->palette ? palette_bytes(sorted[i]) : 0;
+		pos += (pal + PACK_ALIGN - 1) & ~(size_t)(PACK_ALIGN - 1);
+		pos += sorted[i]->img_bytes;
+	}
+
+	memset(rec,0,PACK_HDR);
+	memcpy(rec,PACK_MAGIC,8);
+	put32(rec + 8,n);
+	put_off(rec + 12,PACK_HDR);
+	put_off(rec + 20,PACK_HDR + (off_t)n * PACK_REC);
+	put32(rec + 28,names);
+	fwrite(rec,1,PACK_HDR,f);
+
+	for (i = 0, names = 0; i < n; i++) {
+		bitmap_s *bmp = sorted[i];
+
+		pal = bmp->palette ? palette_bytes(bmp) : 0;
+		memset(rec,0,PACK_REC);
+		put32(rec,names);
+		put32(rec + 4,strlen(bmp->name));
+		put_off(rec + 8,at[i] + ((pal + PACK_ALIGN - 1)
+			& ~(size_t)(PACK_ALIGN - 1)));
+		put32(rec + 16,bmp->ih.w);
+		put32(rec + 20,bmp->ih.h);
+		rec[24] = bmp->ih.bpp & 0xFF;
+		rec[25] = bmp->ih.bpp >> 8;
+		put32(rec + 28,pal ? pal >> 2 : 0);
+		if (pal) {
+			put_off(rec + 32,at[i]);
+		}
+		put32(rec + 40,bmp->ih.hres);
+		put32(rec + 44,bmp->ih.vres);
+		fwrite(rec,1,PACK_REC,f);
+		names += strlen(bmp->name);
+	}
+	for (i = 0; i < n; i++) {
+		fwrite(sorted[i]->name,1,strlen(sorted[i]->name),f);
+	}
+
+	for (i = 0; i < n; i++) {
+		bitmap_s *bmp = sorted[i];
+
+		pal = bmp->palette ? palette_bytes(bmp) : 0;
+		fseeko(f,at[i],SEEK_SET);
+		if (pal) {
+			fwrite(bmp->palette,1,pal,f);
+			fseeko(f,at[i] + ((pal + PACK_ALIGN - 1)
+				& ~(size_t)(PACK_ALIGN - 1)),SEEK_SET);
+		}
+		fwrite(bmp->img,1,bmp->img_bytes,f);
+	}
+
+	if (fflush(f) || ferror(f)) {
+		warn("Failed to write file",fname);
+		ok = 0;
+	}
+	fclose(f);
+	free(sorted);
+	free(at);
+
+	return ok;
+}
+
+
+/* map an archive into memory, NULL on error. */
+pack
+bmp_pack_open(const char *fname)
+{
+	struct pack_s *p;
+	struct stat st;
+	size_t index;
+	size_t names;
+	void *map;
+	int fd;
+
+	if ((fd = open(fname,O_RDONLY)) == -1) {
+		warn("failed to open",fname);
+		return NULL;
+	}
+	if (fstat(fd,&st) == -1 || st.st_size < PACK_HDR
+	    || (off_t)(size_t)st.st_size != st.st_size) {
+		warn("invalid archive",fname);
+		close(fd);
+		return NULL;
+	}
+
+	/* private and writable, so views can be changed without copying
+	   them first, and without touching the file. */
+	map = mmap(NULL,st.st_size,PROT_READ | PROT_WRITE,MAP_PRIVATE,fd,0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warn("failed to map",fname);
+		return NULL;
+	}
+
+	if (!(p = malloc(sizeof *p))) {
+		fatal("memory exhausted");
+	}
+	p->map = map;
+	p->size = st.st_size;
+	p->count = read32(p->map + 8);
+	p->names_size = read32(p->map + 28);
+
+	if (memcmp(p->map,PACK_MAGIC,8) != 0
+	    || !get_off(p->map + 12,&index) || !get_off(p->map + 20,&names)
+	    || p->count > (p->size - PACK_HDR) / PACK_REC
+	    || !pack_span(p,index,(size_t)p->count * PACK_REC)
+	    || !pack_span(p,names,p->names_size)) {
+		warn("invalid archive",fname);
+		munmap(map,p->size);
+		free(p);
+		return NULL;
+	}
+	p->index = p->map + index;
+	p->names = p->map + names;
+
+	return (pack)p;
+}
+
+
+/* unmap an archive, destroying every bitmap_s struct that points into it. */
+void *
+bmp_pack_close(pack p)
+{
+	struct ref_s *cur, *next;
+
+	if (p) {
+		for (cur = ref_head; cur; cur = next) {
+			next = cur->next;
+			if (cur->bmp->pack == p) {
+				ref_del(cur);
+			}
+		}
+		munmap(p->map,p->size);
+		free(p);
+	}
+	return NULL;
+}
+
+
+/* number of images in an archive. */
+int
+bmp_pack_count(pack p)
+{
+	return p ? (int)p->count : 0;
+}
+
+
+/* id of the image with the given name, -1 if there is none. */
+int
+bmp_pack_find(pack p, const char *name)
+{
+	const unsigned char *s;
+	size_t len, klen, n;
+	unsigned int lo = 0, hi, mid;
+	int c;
+
+	if (!p || !name) {
+		return -1;
+	}
+
+	klen = strlen(name);
+	for (hi = p->count; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (!(s = pack_name(p,mid,&len))) {
+			return -1;
+		}
+		n = (len < klen) ? len : klen;
+		if ((c = memcmp(s,name,n)) == 0) {
+			c = (len > klen) - (len < klen);
+		}
+		if (c == 0) {
+			return mid;
+		} else if (c < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return -1;
+}
+
+
+/* returns a bitmap_s struct pointing into the archive, NULL on error. */
+bitmap
+bmp_pack_get(pack p, int id)
+{
+	bitmap_s *bmp;
+	const unsigned char *r, *s;
+	size_t data, pal = 0, len;
+
+	if (!p || id < 0 || (unsigned int)id >= p->count) {
+		return NULL;
+	}
+	r = p->index + (size_t)id * PACK_REC;
+
+	if (!(bmp = init(""))) {
+		fatal("memory exhausted");
+	}
+	bmp->pack = p;
+
+	if ((s = pack_name(p,id,&len))) {
+		if (len > PATH_MAX - 1) {
+			len = PATH_MAX - 1;
+		}
+		memcpy(bmp->name,s,len);
+		bmp->name[len] = '\0';
+	}
+
+	memcpy(bmp->fh.signature,"BM",2);
+	bmp->fh.reserved = 0;
+	bmp->ih.ih_size = 40;
+	bmp->ih.w = read32(r + 16);
+	bmp->ih.h = read32(r + 20);
+	bmp->ih.planes = 1;
+	bmp->ih.compress = 0;
+	bmp->ih.num_colors = read32(r + 28);
+	bmp->ih.num_important = 0;
+	bmp->ih.hres = read32(r + 40);
+	bmp->ih.vres = read32(r + 44);
+	bmp->fh.dib_offset = 54 + (bmp->ih.num_colors << 2);
+
+	if (!s || !get_off(r + 8,&data) || !get_off(r + 32,&pal)
+	    || bmp->ih.num_colors > 256
+	    || !set_size(bmp,r[24] | r[25] << 8)
+	    || !pack_span(p,data,bmp->img_bytes)
+	    || (pal && !pack_span(p,pal,palette_bytes(bmp)))) {
+		warn("archive index corrupt",bmp->name);
+		return bmp_destroy(bmp);
+	}
+
+	bmp->img = p->map + data;
+	if (pal) {
+		bmp->palette = p->map + pal;
+	}
+
+	return (bitmap)bmp;
+}
+
+
+/* returns a bitmap_s struct for the named image in the archive, NULL if
+   there is no such image. */
+bitmap
+bmp_pack_load(pack p, const char *name)
+{
+	int id = bmp_pack_find(p,name);
+
+	return (id < 0) ? NULL : bmp_pack_get(p,id);
+}
+
+
+/* cleanup memory allocated previously to the given bitmap_s struct. */
+void *
+bmp_destroy(bitmap bmp)
+{	
+	struct ref_s *ref;
+	
+	if (bmp) {
+		if ((ref = ref_exists(bmp))) {
+			ref_del(ref);
+		}
+	}	
+	
+	return NULL;
+}
+
+
+/* cleanup memory allocated to all previously allocated bitmap_s structs. */ 
+void
+bmp_gc(void)
+{
+	while (ref_count) {
+		ref_del(ref_head);
+	}	
+}
+
+
+/* write a bitmap_s struct out to file. the filename is taken from the
+   bitmap_s structs name field. */
+void
+bmp_write(bitmap bmp) 
+{
+	int x = 1;
+	unsigned int y, h;
+	off_t pal_at, dib_at;
+	size_t pal;
+	FILE *f;
+
+	if (!bmp) {
+		return;
 	}
 
 	if (!(f = fopen(bmp->name,"wb"))) {
 		warn("Failed to open file",bmp->name);
 		return;
 	}	
+
+	/* taken before the headers are byte swapped below. */
+	h = bmp->ih.h;
+	pal = bmp->palette ? palette_bytes(bmp) : 0;
+	pal_at = (off_t)14 + bmp->ih.ih_size;
+	dib_at = (off_t)bmp->fh.dib_offset;
 	
 	/* is this a big endian machine? */
 	if (*(char *)&x != 1) {
@@ -530,9 +2658,17 @@ bmp_write(bitmap bmp)
 	fwrite(&bmp->ih.num_colors   ,4,1,f);
 	fwrite(&bmp->ih.num_important,4,1,f);
 
-	/* image */
-	fseek(f,bmp->fh.dib_offset,SEEK_SET);
-	fwrite(bmp->img,bmp->ih.img_size,1,f);
+	/* palette, immediately after the info header */
+	if (pal) {
+		fseeko(f,pal_at,SEEK_SET);
+		fwrite(bmp->palette,1,pal,f);
+	}
+
+	/* image, bottom scanline first as it is stored in the file */
+	fseeko(f,dib_at,SEEK_SET);
+	for (y = h; y > 0; y--) {
+		fwrite(bmp->img + (y - 1) * bmp->stride,1,bmp->stride,f);
+	}
 
 	fflush(f);
 	fclose(f);
@@ -555,7 +2691,10 @@ bmp_info(bitmap bmp)
 	fprintf(stdout,"%-25s : %d\n","Height",bmp->ih.h);
 	fprintf(stdout,"%-25s : %d\n","Number of planes",bmp->ih.planes);
 	fprintf(stdout,"%-25s : %d\n","Bits Per Pixel",bmp->ih.bpp);
-	fprintf(stdout,"%-25s : %d\n","Image size (bytes)",bmp->ih.img_size);
+	fprintf(stdout,"%-25s : %lu\n","Scanline stride (bytes)",
+		(unsigned long)bmp->stride);
+	fprintf(stdout,"%-25s : %lu\n","Image size (bytes)",
+		(unsigned long)bmp->img_bytes);
 	fprintf(stdout,"%-25s : %d\n","Horizontal resolution",bmp->ih.hres);
 	fprintf(stdout,"%-25s : %d\n","Vertical resolution",bmp->ih.vres);
 	fprintf(stdout,"%-25s : %d\n","Number of colors",bmp->ih.num_colors);
@@ -32,6 +32,8 @@
 /*#include <limits.h> */
 #define PATH_MAX	256
 
+#include <stddef.h>
+
 
 /** file header structure. */
 typedef struct {
@@ -63,11 +65,55 @@ typedef struct {
 	info_hdr_s ih;		/* image header */
 	unsigned char *palette;	/* palette for <= 8 bit images */
 	unsigned char *img;	/* DIB raster image */
+	size_t stride;		/* bytes per scanline, including padding */
+	size_t img_bytes;	/* size of raster image in memory */
+	void *pack;		/* archive holding img and palette, if any */
 } bitmap_s;
 
 /* shelter users from misuse. */
 typedef bitmap_s *bitmap;
 
+/** channel orders, named by byte order in memory. */
+typedef enum {
+	BMP_BGRA,		/* native 32 bit DIB order */
+	BMP_RGBA,
+	BMP_ARGB,
+	BMP_ABGR,
+	BMP_BGR,		/* native 24 bit DIB order */
+	BMP_RGB
+} bmp_order_e;
+
+/** sample types for separate colour planes. */
+typedef enum {
+	BMP_U8,			/* unsigned char */
+	BMP_U16,		/* unsigned short */
+	BMP_F32			/* float */
+} bmp_sample_e;
+
+/** separate colour planes of an image. */
+typedef struct {
+	unsigned int w;		/* width of each plane */
+	unsigned int h;		/* height of each plane */
+	int channels;		/* 3 for red, green and blue, 4 adds alpha */
+	bmp_sample_e type;	/* type of every sample */
+	size_t pitch;		/* bytes between the start of each row */
+	void *plane[4];		/* red, green, blue and alpha planes */
+	void *mem;		/* block holding the planes, if allocated */
+} planar_s;
+
+typedef planar_s *planar;
+
+/* an open archive of packed bitmaps. */
+typedef struct pack_s *pack;
+
+/** result of comparing the pixels of two images. */
+typedef struct {
+	int equal;		/* non-zero if all pixel data matches */
+	double mae;		/* mean absolute error per byte */
+	double mse;		/* mean squared error per byte */
+	double psnr;		/* peak signal to noise ratio in dB */
+} compare_s;
+
 
 /*!
  *  WARNING - any call to the functions provided may result in exhausting
@@ -115,6 +161,16 @@ extern int bmp_get_width(bitmap bmp);
  */
 extern int bmp_get_height(bitmap bmp);
 
+/*!
+ *  bmp_get_stride returns the number of bytes between the start of one
+ *  scanline and the next in the image returned by bmp_get_img. Each scanline
+ *  is padded to a double word boundary, so this may be larger than the width
+ *  multiplied by the bytes per pixel.
+ *  bmp must be a non-null, validated bitmap. If either of these conditions are
+ *  false, behaviour is undefined.
+ */
+extern size_t bmp_get_stride(bitmap bmp);
+
 /*!
  *  bmp_destroy should be used to free any memory allocated to the bitmap bmp. 
  *  null is gauranteed to be returned, which should be assigned back to the 
@@ -172,4 +228,178 @@ extern bitmap bmp_convert24to32(bitmap bmp, char *name);
  */
 extern bitmap bmp_convert24to16(bitmap bmp, char *name);
 
+/*!
+ *  bmp_convert24to8 converts a 24 bit bitmap to an 8 bit bitmap with a
+ *  palette of at most colors entries, where colors is between 2 and 256.
+ *  The palette is built by median cut over a sample of the image, and each
+ *  pixel is mapped to its nearest palette entry. If cache is non-zero the
+ *  nearest entry is looked up once per 15 bit colour and reused, which is
+ *  far faster on large images at a small cost in accuracy. name is the name
+ *  to call the new bitmap. A null bitmap, one of any other bit depth, or
+ *  colors out of range will result in the call returning NULL. On success,
+ *  a new 8 bit bitmap will be returned, with num_colors set to the number of
+ *  palette entries used.
+ */
+extern bitmap bmp_convert24to8(bitmap bmp, char *name, int colors, int cache);
+
+/*!
+ *  bmp_load_order reads a 24 or 32 bit bitmap into memory in the same way as
+ *  bmp_load, but rearranges each pixel into the channel order given by order
+ *  as the scanlines are read, so no second pass over the image is needed.
+ *  BMP_BGR and BMP_RGB give a 24 bit image, all other orders give a 32 bit
+ *  image with every alpha byte set to alpha. Scanlines remain padded to a
+ *  double word boundary. Note that an image in anything other than BGR(A)
+ *  order is no longer a valid DIB, and should not be passed to bmp_write.
+ *  On failure a message is sent to stderr and a null pointer is returned.
+ */
+extern bitmap bmp_load_order(const char *fname, bmp_order_e order,
+	unsigned char alpha);
+
+/*!
+ *  bmp_convert_order converts a 24 or 32 bit bitmap into a new bitmap with
+ *  the channel order given by order, as described for bmp_load_order. name
+ *  is the name to call the new bitmap. A null bitmap, or one of any other
+ *  bit depth, will result in the call returning NULL. On success, a new
+ *  bitmap will be returned.
+ */
+extern bitmap bmp_convert_order(bitmap bmp, char *name, bmp_order_e order,
+	unsigned char alpha);
+
+/*!
+ *  bmp_rotate90, bmp_rotate180 and bmp_rotate270 rotate an 8, 16, 24 or 32
+ *  bit bitmap clockwise by 90, 180 or 270 degrees, as the image is viewed.
+ *  name is the name to call the new bitmap, in case the user wants to later
+ *  write this bitmap out to file. The width and height, and the horizontal
+ *  and vertical resolutions, are swapped by a quarter turn. A null bitmap,
+ *  or one of any other bit depth, will result in the call returning NULL.
+ *  On success, a new bitmap will be returned.
+ */
+extern bitmap bmp_rotate90(bitmap bmp, char *name);
+extern bitmap bmp_rotate180(bitmap bmp, char *name);
+extern bitmap bmp_rotate270(bitmap bmp, char *name);
+
+/*!
+ *  bmp_flip_h mirrors an 8, 16, 24 or 32 bit bitmap left to right, and
+ *  bmp_flip_v mirrors it top to bottom. name is the name to call the new
+ *  bitmap. A null bitmap, or one of any other bit depth, will result in the
+ *  call returning NULL. On success, a new bitmap will be returned.
+ */
+extern bitmap bmp_flip_h(bitmap bmp, char *name);
+extern bitmap bmp_flip_v(bitmap bmp, char *name);
+
+/*!
+ *  bmp_to_planar splits a 24 or 32 bit bitmap into separate red, green and
+ *  blue planes, plus an alpha plane taken from the fourth byte of each 32 bit
+ *  pixel, with every sample stored as the given type. Sample values are
+ *  left in the range 0 to 255 whatever the type. Rows are top to bottom.
+ *  If align is non-zero it must be a power of two; each plane then starts
+ *  on an align byte boundary and each row is padded to a multiple of align
+ *  bytes, so loops over a row never need a scalar tail. The planes are not
+ *  bitmaps and are not freed by bmp_gc, so they must be released with
+ *  bmp_planar_destroy. A null bitmap, or one of any other bit depth, will
+ *  result in the call returning NULL.
+ */
+extern planar bmp_to_planar(bitmap bmp, bmp_sample_e type, size_t align);
+
+/*!
+ *  bmp_from_planar interleaves the planes of pl into a new 24 or 32 bit
+ *  bitmap, as given by bpp. name is the name to call the new bitmap. pl may
+ *  come from bmp_to_planar or be filled in by the caller to describe planes
+ *  of their own, in which case mem is ignored. Samples are rounded and
+ *  clamped to the range 0 to 255. When pl has no alpha plane the fourth byte
+ *  of each 32 bit pixel is 0. A null pl or any other bpp will result in the
+ *  call returning NULL. On success, a new bitmap will be returned.
+ */
+extern bitmap bmp_from_planar(planar pl, char *name, int bpp);
+
+/*!
+ *  bmp_planar_destroy frees planes allocated by bmp_to_planar. null is
+ *  gauranteed to be returned. Passing a null pointer is harmless.
+ */
+extern void * bmp_planar_destroy(planar pl);
+
+/*!
+ *  bmp_compare compares the pixel data of bitmaps a and b, which must have
+ *  the same width, height and bit depth. Only the pixels of each scanline
+ *  are compared, never its padding, including any unused low bits of the
+ *  last byte of 1 and 4 bit scanlines. Each byte is treated as a sample, so
+ *  the error measures are meaningful for 8 bit greyscale, 24 and 32 bit
+ *  images. All results are gathered in a single pass and stored in res.
+ *  psnr is HUGE_VAL when the images are equal. Returns non-zero on
+ *  success, or 0 if either bitmap is null or their shapes differ, in which
+ *  case res is untouched.
+ */
+extern int bmp_compare(bitmap a, bitmap b, compare_s *res);
+
+/*!
+ *  bmp_hash returns the 32 bit xxHash32 digest of the pixel data of bmp,
+ *  taken as if the scanlines were stored without padding, from top to
+ *  bottom. Unused low bits of the last byte of 1 and 4 bit scanlines are
+ *  hashed as zero. seed varies the digest. The dimensions are not part of the
+ *  digest, so callers looking for duplicates should compare those as well.
+ *  A null bitmap returns 0.
+ */
+extern unsigned int bmp_hash(bitmap bmp, unsigned int seed);
+
+/*!
+ *  bmp_histogram counts the values of each byte of the pixels of an 8, 24
+ *  or 32 bit bitmap. hist must have room for 4 channels; hist[0] counts the
+ *  first byte of each pixel (blue, or the palette index of an 8 bit image),
+ *  hist[1] the second and so on. Returns the number of channels counted, or
+ *  0 for a null bitmap or any other bit depth.
+ */
+extern int bmp_histogram(bitmap bmp, unsigned long hist[][256]);
+
+/*!
+ *  bmp_pack_write packs the n bitmaps in bmps into a single archive file
+ *  fname, indexed by the name field of each bitmap so they can later be
+ *  found with bmp_pack_find. Names must be unique. Any bit depth may be
+ *  packed. Returns non-zero on success. On failure a message is sent to
+ *  stderr and 0 is returned.
+ */
+extern int bmp_pack_write(const char *fname, bitmap *bmps, int n);
+
+/*!
+ *  bmp_pack_open maps an archive written by bmp_pack_write into memory.
+ *  Nothing is read until images are asked for, so opening is cheap however
+ *  many images the archive holds. On failure a message is sent to stderr
+ *  and a null pointer is returned.
+ */
+extern pack bmp_pack_open(const char *fname);
+
+/*!
+ *  bmp_pack_close unmaps an archive. Every bitmap obtained from it is
+ *  destroyed, as if passed to bmp_destroy. null is gauranteed to be
+ *  returned. Passing a null pointer is harmless.
+ */
+extern void * bmp_pack_close(pack p);
+
+/*!
+ *  bmp_pack_count returns the number of images in the archive p. Images
+ *  have ids from 0 to one less than this, in order of name.
+ */
+extern int bmp_pack_count(pack p);
+
+/*!
+ *  bmp_pack_find returns the id of the image called name in the archive p,
+ *  found by binary search of the index, or -1 if there is no such image.
+ */
+extern int bmp_pack_find(pack p, const char *name);
+
+/*!
+ *  bmp_pack_get returns the image with the given id from the archive p as a
+ *  bitmap whose image and palette point directly into the mapped archive;
+ *  no pixels are copied. Changes to the image are private to this process
+ *  and never reach the archive. The bitmap behaves as any other until the
+ *  archive is closed, when it is destroyed. A bad id, or a corrupt index
+ *  entry, will result in the call returning NULL.
+ */
+extern bitmap bmp_pack_get(pack p, int id);
+
+/*!
+ *  bmp_pack_load is bmp_pack_get for the image called name, or NULL if
+ *  there is no such image.
+ */
+extern bitmap bmp_pack_load(pack p, const char *name);
+
 #endif /* __BMP_H */	
@@ -28,12 +28,36 @@
 #ifndef __BMP_INTERNAL_H
 #define __BMP_INTERNAL_H
 
+/* large file support, so offsets beyond 2GB work on 32 bit hosts. */
+#define _FILE_OFFSET_BITS	64
+#define _XOPEN_SOURCE		500
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "bmp.h"
 
+/* SSE2, SSSE3 and SSE4.1 are used by the pixel kernels when available. */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+
+/* pixels along each side of a square tile processed by the transposes */
+#define TILE	32
+
 /* this macro is used to convert byte order to big endian */
 #define _BSWAP_32(x) \
         ((((x) & 0xff000000) >> 24) | (((x) & 0x00ff0000) >>  8) | \
@@ -48,6 +72,16 @@
 #define BSWAP_16(x) \
 	x = _BSWAP_16(x)
 
+/* xxHash32 primes, used by bmp_hash */
+#define XXH_P1	2654435761U
+#define XXH_P2	2246822519U
+#define XXH_P3	3266489917U
+#define XXH_P4	668265263U
+#define XXH_P5	374761393U
+
+#define XXH_ROTL(x, r) \
+	(((x) << (r)) | ((x) >> (32 - (r))))
+
 extern int errno;
 
 /* 
@@ -60,4 +94,46 @@ struct ref_s {
 	bitmap_s *bmp;
 };
 
+/*
+ * running state of an xxHash32 digest, so scanlines can be hashed one at
+ * a time without their padding.
+ */
+struct xxh_s {
+	unsigned int v[4];	/* accumulators, one per 4 byte lane */
+	unsigned int len;	/* bytes hashed, modulo 2^32 */
+	int large;		/* non-zero once 16 or more bytes are seen */
+	unsigned char buf[16];	/* bytes waiting for a full stripe */
+	int used;		/* bytes held in buf */
+	unsigned int seed;
+};
+
+/*
+ * layout of a packed archive. all fields are little endian, and 64 bit
+ * offsets are stored as low then high 32 bit words.
+ *
+ * offset | size     | contents
+ * ------------------------------------------------------------
+ * 0      | 64       | header: magic, count, index and name offsets
+ * 64     | 48 * n   | index, sorted by name
+ * ...    | ...      | names, not nul terminated
+ * ...    | ...      | palettes and rasters, each PACK_ALIGN aligned
+ *
+ * rasters are stored exactly as held in memory, top scanline first and
+ * padded to a double word, so a view can point straight into the map.
+ */
+#define PACK_MAGIC	"DIBPACK1"
+#define PACK_HDR	64
+#define PACK_REC	48
+#define PACK_ALIGN	64
+
+/* a mapped archive, handed out to users as a pack. */
+struct pack_s {
+	unsigned char *map;		/* the whole archive */
+	size_t size;			/* bytes mapped */
+	unsigned int count;		/* number of images */
+	const unsigned char *index;	/* first index record */
+	const unsigned char *names;	/* name table */
+	size_t names_size;		/* bytes in the name table */
+};
+
 #endif	/* __BMP_INTERNAL_H */
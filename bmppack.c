@@ -0,0 +1,104 @@
+/*
+    This file is part of LibDIB.
+    Copyright (C) 2003 Grant Byers.
+
+    Author: Grant Byers
+
+    bmppack packs many bitmap images into a single archive which can be
+    mapped into memory with bmp_pack_open, or lists the contents of such
+    an archive.
+
+    LibDIB is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "bmp.h"
+
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,"usage: %s archive file.bmp ...\n",prog);
+	fprintf(stderr,"       %s -t archive\n",prog);
+	exit(EXIT_FAILURE);
+}
+
+
+/*
+ * list each image in the archive, in index order.
+ */
+static int
+list(const char *fname)
+{
+	pack p;
+	bitmap bmp;
+	int i, n;
+
+	if (!(p = bmp_pack_open(fname))) {
+		return EXIT_FAILURE;
+	}
+
+	n = bmp_pack_count(p);
+	for (i = 0; i < n; i++) {
+		if ((bmp = bmp_pack_get(p,i))) {
+			fprintf(stdout,"%8d %6d x %-6d %2d  %s\n",i,
+				bmp_get_width(bmp),bmp_get_height(bmp),
+				bmp->ih.bpp,bmp->name);
+			bmp_destroy(bmp);
+		}
+	}
+
+	bmp_pack_close(p);
+	return EXIT_SUCCESS;
+}
+
+
+int
+main(int argc, char **argv)
+{
+	bitmap *bmps;
+	int i, n;
+
+	atexit(bmp_gc);
+
+	if (argc == 3 && strcmp(argv[1],"-t") == 0) {
+		return list(argv[2]);
+	}
+	if (argc < 2 || argv[1][0] == '-') {
+		usage(argv[0]);
+	}
+
+	n = argc - 2;
+	if (!(bmps = malloc((n + 1) * sizeof *bmps))) {
+		fprintf(stderr,"Fatal error occured: memory exhausted\n");
+		return EXIT_FAILURE;
+	}
+
+	/* each image is indexed by the name it was loaded from. */
+	for (i = 0; i < n; i++) {
+		if (!(bmps[i] = bmp_load(argv[i + 2]))) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!bmp_pack_write(argv[1],bmps,n)) {
+		return EXIT_FAILURE;
+	}
+
+	free(bmps);
+	return EXIT_SUCCESS;
+}